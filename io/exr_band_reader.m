@@ -0,0 +1,114 @@
+% *************************************************************************
+% * Copyright 2026 Sebastian Merzbach
+% *
+% * authors:
+% *  - Sebastian Merzbach <smerzbach@gmail.com>
+% *
+% * file creation date: 2026-10-16
+% *
+% * This file is part of smml.
+% *
+% * smml is free software: you can redistribute it and/or modify it under
+% * the terms of the GNU Lesser General Public License as published by the
+% * Free Software Foundation, either version 3 of the License, or (at your
+% * option) any later version.
+% *
+% * smml is distributed in the hope that it will be useful, but WITHOUT
+% * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+% * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+% * License for more details.
+% *
+% * You should have received a copy of the GNU Lesser General Public
+% * License along with smml.  If not, see <http://www.gnu.org/licenses/>.
+% *
+% *************************************************************************
+%
+% Function for reading OpenEXR images that are too large to fit into
+% memory in horizontal bands of scan lines. Usage:
+%
+% [handle, info] = exr_band_reader('open', filename, varargin)
+%   opens the file, header and offset table are parsed only once; the
+%   optional name-value pairs are:
+%   - pixel_type and channel_mask, with the same meaning as for exr_read()
+%   - band_height, the number of scan lines returned per call, defaults
+%     to 256
+%   - prefetch, if true (default), the next band is decoded on a
+%     background thread while the current one is processed
+%   info is a struct with the fields width, height and channel_names
+% [band, y_first] = exr_band_reader('read', handle)
+%   returns the next band as a band_height x W x C array (the last band
+%   might have fewer scan lines) together with the 1-based index of its
+%   first scan line; band is empty once the whole image has been read
+% exr_band_reader('close', handle)
+%   closes the file, this also happens for all open files when the MEX file
+%   is cleared
+%
+% Example, computing the channel means of a huge image:
+%
+% [h, info] = exr_band_reader('open', 'huge.exr', 'band_height', 512);
+% sums = zeros(1, numel(info.channel_names));
+% band = exr_band_reader('read', h);
+% while ~isempty(band)
+%     sums = sums + reshape(sum(sum(band, 1), 2), 1, []);
+%     band = exr_band_reader('read', h);
+% end
+% exr_band_reader('close', h);
+% means = sums / (info.width * info.height);
+function varargout = exr_band_reader(mode, target, varargin)
+    % avoid expensive checks in mex_auto when it's not necessary
+    [varargin, dontbuild] = arg(varargin, 'dontbuild', false, false);
+
+    % get folder containing this script
+    mdir = fileparts(mfilename('fullpath'));
+    header_dir = fullfile(mdir, '..', 'external', 'tinyexr');
+
+    % initiate automatic MEX compilation
+    mex_auto(...
+        'dontbuild', dontbuild, ...
+        'sources', {'exr_band_reader_mex.cpp'}, ...
+        'headers', {'tinyexr.h', 'exr_chunks.h'}, ...
+        'openmp', true, ...
+        ['-I', header_dir]);
+
+    varargout = cell(1, max(1, nargout));
+    switch lower(mode)
+        case 'open'
+            [varargin, pixel_type] = arg(varargin, 'pixel_type', 'single', false);
+            [varargin, band_height] = arg(varargin, 'band_height', 256, false);
+            [varargin, channel_mask] = arg(varargin, 'channel_mask', [], false);
+            [varargin, prefetch] = arg(varargin, 'prefetch', true, false);
+            arg(varargin);
+
+            switch lower(pixel_type)
+                case 'uint'
+                    pixel_type = 0;
+                case 'half'
+                    pixel_type = 1;
+                case {'single', 'float'}
+                    pixel_type = 2;
+                case 'double'
+                    pixel_type = 3;
+                otherwise
+                    error('exr_band_reader:invalid_requested_pixel_type', ...
+                        'requested_pixel_type must be one of ''uint'', ''half'', ''single'' or ''double''.');
+            end
+
+            % C++ 0-based indexing, an empty channel mask selects all
+            % channels
+            [varargout{:}] = exr_band_reader_mex('open', target, pixel_type, ...
+                band_height, channel_mask - 1, prefetch);
+        case 'read'
+            arg(varargin);
+            [varargout{:}] = exr_band_reader_mex('read', target);
+            if nargout > 1
+                varargout{2} = varargout{2} + 1;
+            end
+        case 'close'
+            arg(varargin);
+            exr_band_reader_mex('close', target);
+            varargout = {};
+        otherwise
+            error('exr_band_reader:invalid_mode', ...
+                'mode must be one of ''open'', ''read'' or ''close''.');
+    end
+end
@@ -0,0 +1,291 @@
+/**************************************************************************
+ * Copyright 2026 Sebastian Merzbach
+ *
+ * authors:
+ *  - Sebastian Merzbach <smerzbach@gmail.com>
+ *
+ * file creation date: 2026-10-16
+ *
+ * This file is part of smml.
+ *
+ * smml is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * smml is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with smml.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ **************************************************************************
+ *
+ * Mex file for reading huge OpenEXR images in horizontal bands of scan
+ * lines, so that only one band has to be kept in memory at a time. Usage:
+ *
+ * [handle, info] = exr_band_reader_mex('open', filename, pixel_type,
+ *   band_height, channel_mask, prefetch)
+ *   opens the file and parses header and offset table once; pixel_type and
+ *   channel_mask have the same meaning as for exr_read_mex(), if prefetch
+ *   is true, the next band is decoded on a background thread while the
+ *   current one is being processed in Matlab; info is a struct with the
+ *   fields width, height and channel_names
+ * [band, y_first] = exr_band_reader_mex('read', handle)
+ *   returns the next band of band_height scan lines (fewer for the last
+ *   band) and the 0-based index of its first scan line, band is empty once
+ *   all scan lines have been read
+ * exr_band_reader_mex('close', handle)
+ *   closes the file, all open readers are closed when the MEX file is
+ *   cleared
+ */
+
+#include <cstdint>
+#include <future>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <mex.h>
+
+#define TINYEXR_IMPLEMENTATION
+#include "tinyexr.h"
+
+#include "exr_chunks.h"
+
+// size in bytes and Matlab class of the output samples for each pixel type
+static const size_t sample_sizes[] = {4, 2, 4, 8};
+static const mxClassID class_ids[] = {mxUINT32_CLASS, mxUINT16_CLASS, mxSINGLE_CLASS, mxDOUBLE_CLASS};
+
+class BandReader {
+public:
+    BandReader(const std::string& filename, int pixel_type, int band_height,
+            const double* pChannelMask, size_t num_channels_mask, bool prefetch) :
+            file_(filename), pixel_type_(pixel_type), band_height_(band_height),
+            prefetch_(prefetch), next_y_(0), prefetch_y_(-1) {
+        if (!exr_chunks::can_decode_chunks(file_.header())) {
+            throw std::runtime_error("compression type " +
+                    std::to_string(file_.header().compression_type) +
+                    " cannot be read in bands.");
+        }
+        request_ = exr_chunks::make_request(file_.header(), NULL, NULL, pChannelMask,
+                num_channels_mask);
+        file_.read_offsets(0, offsets_);
+    }
+
+    ~BandReader() {
+        // the background thread accesses the mapped file
+        if (pending_.valid()) {
+            pending_.wait();
+        }
+    }
+
+    int width() {
+        return file_.width();
+    }
+
+    int height() {
+        return file_.height();
+    }
+
+    const std::vector<size_t>& channel_mask() const {
+        return request_.channel_mask;
+    }
+
+    const EXRHeader& header() {
+        return file_.header();
+    }
+
+    // decode the next band into a new Matlab array, returns an empty array
+    // once all scan lines have been read
+    mxArray* read(int& y_first) {
+        y_first = next_y_;
+        const int num_lines = std::min(band_height_, height() - next_y_);
+        if (num_lines <= 0) {
+            return mxCreateNumericMatrix(0, 0, class_ids[pixel_type_], mxREAL);
+        }
+        mwSize dims[3] = {(mwSize) num_lines, (mwSize) width(), request_.channel_mask.size()};
+        mxArray* band = mxCreateUninitNumericArray(3, dims, class_ids[pixel_type_], mxREAL);
+        try {
+            if (pending_.valid() && prefetch_y_ == next_y_) {
+                pending_.get();
+                memcpy(mxGetData(band), &prefetch_buffer_[0], prefetch_buffer_.size());
+            } else {
+                if (pending_.valid()) {
+                    pending_.wait();
+                }
+                decode_band(next_y_, num_lines, mxGetData(band));
+            }
+        } catch (std::exception&) {
+            mxDestroyArray(band);
+            throw;
+        }
+        next_y_ += num_lines;
+
+        // decode the following band while Matlab processes this one
+        const int num_lines_next = std::min(band_height_, height() - next_y_);
+        if (prefetch_ && num_lines_next > 0) {
+            prefetch_y_ = next_y_;
+            prefetch_buffer_.resize((size_t) num_lines_next * width() *
+                    request_.channel_mask.size() * sample_sizes[pixel_type_]);
+            pending_ = std::async(std::launch::async, &BandReader::decode_band, this,
+                    prefetch_y_, num_lines_next, (void*) &prefetch_buffer_[0]);
+        }
+        return band;
+    }
+
+private:
+    BandReader(const BandReader&);
+    BandReader& operator=(const BandReader&);
+
+    // decode num_lines scan lines starting at y_first into out
+    void decode_band(int y_first, int num_lines, void* out) {
+        exr_chunks::ReadRequest request = request_;
+        request.roi[1] = y_first;
+        request.roi[3] = y_first + num_lines - 1;
+        switch (pixel_type_) {
+            case TINYEXR_PIXELTYPE_UINT:
+                decode(request, (uint32_t*) out);
+                break;
+            case TINYEXR_PIXELTYPE_HALF:
+                decode(request, (uint16_t*) out);
+                break;
+            case TINYEXR_PIXELTYPE_FLOAT:
+                decode(request, (float*) out);
+                break;
+            default:
+                decode(request, (double*) out);
+        }
+    }
+
+    template <typename T>
+    void decode(const exr_chunks::ReadRequest& request, T* out) {
+        if (file_.header().tiled) {
+            exr_chunks::read_tiles(file_.data(), file_.size(), file_.header(), offsets_, request,
+                    out);
+        } else {
+            exr_chunks::read_scanlines(file_.data(), file_.size(), file_.header(), offsets_,
+                    request, out);
+        }
+    }
+
+    exr_chunks::ExrFile file_;
+    exr_chunks::ReadRequest request_;
+    std::vector<uint64_t> offsets_;
+    int pixel_type_;
+    int band_height_;
+    bool prefetch_;
+    int next_y_;
+
+    // band that is decoded in the background
+    int prefetch_y_;
+    std::vector<unsigned char> prefetch_buffer_;
+    std::future<void> pending_;
+};
+
+static std::map<uint64_t, std::unique_ptr<BandReader> > readers;
+static uint64_t next_handle = 1;
+
+void atExit() {
+    readers.clear();
+}
+
+BandReader& get_reader(const mxArray* pHandle) {
+    std::map<uint64_t, std::unique_ptr<BandReader> >::iterator it =
+            readers.find((uint64_t) mxGetScalar(pHandle));
+    if (it == readers.end()) {
+        mexErrMsgTxt("invalid handle, the reader is closed or was never opened.\n");
+    }
+    return *it->second;
+}
+
+void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
+{
+    mexAtExit(atExit);
+
+    // check inputs
+    char* mode = nrhs > 0 ? mxArrayToString(prhs[0]) : NULL;
+    if (!mode) {
+        mexErrMsgTxt("Usage: handle = exr_band_reader('open', filename, ...), "
+                "[band, y_first] = exr_band_reader('read', handle), "
+                "exr_band_reader('close', handle)");
+    }
+    std::string str_mode(mode);
+    mxFree(mode);
+
+    if (str_mode == "open") {
+        if (nrhs != 6) {
+            mexErrMsgTxt("Usage: [handle, info] = exr_band_reader_mex('open', filename, pixel_type, band_height, channel_mask, prefetch)");
+        }
+        char* filename = mxArrayToString(prhs[1]);
+        if (!filename) {
+            mexErrMsgTxt("filename must be a string.\n");
+        }
+        std::string str_filename(filename);
+        mxFree(filename);
+
+        int pixel_type = mxGetScalar(prhs[2]);
+        if (0 > pixel_type || pixel_type > 3) {
+            mexErrMsgTxt("requested_pixel_type must be 0 (uint), 1 (half), 2 (float) or 3 (double).\n");
+        }
+        int band_height = mxGetScalar(prhs[3]);
+        if (band_height < 1) {
+            mexErrMsgTxt("band_height must be a positive integer.\n");
+        }
+        const double* pChannelMask = mxIsEmpty(prhs[4]) ? NULL : mxGetPr(prhs[4]);
+        size_t num_channels_mask = mxGetNumberOfElements(prhs[4]);
+        bool prefetch = mxGetScalar(prhs[5]) != 0;
+
+        std::unique_ptr<BandReader> reader;
+        try {
+            reader.reset(new BandReader(str_filename, pixel_type, band_height, pChannelMask,
+                    num_channels_mask, prefetch));
+        } catch (std::exception& e) {
+            mexErrMsgTxt((std::string("error opening EXR file ") + str_filename + ": " +
+                    e.what() + "\n").c_str());
+        }
+
+        plhs[0] = mxCreateDoubleScalar((double) next_handle);
+
+        if (nlhs > 1) {
+            const char* field_names[] = {"width", "height", "channel_names"};
+            plhs[1] = mxCreateStructMatrix(1, 1, 3, field_names);
+            mxSetField(plhs[1], 0, "width", mxCreateDoubleScalar(reader->width()));
+            mxSetField(plhs[1], 0, "height", mxCreateDoubleScalar(reader->height()));
+            const std::vector<size_t>& channel_mask = reader->channel_mask();
+            mxArray* channel_names = mxCreateCellMatrix(1, channel_mask.size());
+            for (size_t ci_out = 0; ci_out < channel_mask.size(); ci_out++) {
+                mxSetCell(channel_names, ci_out,
+                        mxCreateString(reader->header().channels[channel_mask[ci_out]].name));
+            }
+            mxSetField(plhs[1], 0, "channel_names", channel_names);
+        }
+
+        readers[next_handle++] = std::move(reader);
+    } else if (str_mode == "read") {
+        if (nrhs != 2) {
+            mexErrMsgTxt("Usage: [band, y_first] = exr_band_reader_mex('read', handle)");
+        }
+        BandReader& reader = get_reader(prhs[1]);
+        int y_first;
+        try {
+            plhs[0] = reader.read(y_first);
+        } catch (std::exception& e) {
+            mexErrMsgTxt((std::string("error reading band: ") + e.what() + "\n").c_str());
+        }
+        if (nlhs > 1) {
+            plhs[1] = mxCreateDoubleScalar(y_first);
+        }
+    } else if (str_mode == "close") {
+        if (nrhs != 2) {
+            mexErrMsgTxt("Usage: exr_band_reader_mex('close', handle)");
+        }
+        get_reader(prhs[1]);
+        readers.erase((uint64_t) mxGetScalar(prhs[1]));
+    } else {
+        mexErrMsgTxt(("unknown mode " + str_mode + ", must be 'open', 'read' or 'close'.\n").c_str());
+    }
+}
@@ -0,0 +1,1213 @@
+/**************************************************************************
+ * Copyright 2026 Sebastian Merzbach
+ *
+ * authors:
+ *  - Sebastian Merzbach <smerzbach@gmail.com>
+ *
+ * file creation date: 2026-10-16
+ *
+ * This file is part of smml.
+ *
+ * smml is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * smml is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with smml.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ **************************************************************************
+ *
+ * Helpers for accessing individual chunks (blocks of scan lines) of
+ * OpenEXR files, so that only those parts of an image need to be
+ * decompressed that are actually requested.
+ *
+ * The (de)compression routines of tinyexr are reused, so tinyexr.h has to
+ * be included with TINYEXR_IMPLEMENTATION defined before this header.
+ * All functions report errors by throwing std::runtime_error, which makes
+ * them safe to use outside of Matlab's main thread.
+ */
+
+#ifndef EXR_CHUNKS_H
+#define EXR_CHUNKS_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#include <immintrin.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace exr_chunks {
+
+// number of scan lines stored per chunk, 0 if the compression type cannot
+// be decoded chunk by chunk
+inline int lines_per_chunk(int compression_type) {
+    switch (compression_type) {
+        case TINYEXR_COMPRESSIONTYPE_NONE:
+        case TINYEXR_COMPRESSIONTYPE_RLE:
+        case TINYEXR_COMPRESSIONTYPE_ZIPS:
+            return 1;
+        case TINYEXR_COMPRESSIONTYPE_ZIP:
+            return 16;
+#if TINYEXR_USE_PIZ
+        case TINYEXR_COMPRESSIONTYPE_PIZ:
+            return 32;
+#endif
+        default:
+            return 0;
+    }
+}
+
+// size of a single sample in bytes
+inline size_t pixel_type_size(int pixel_type) {
+    return pixel_type == TINYEXR_PIXELTYPE_HALF ? 2 : 4;
+}
+
+// size of all channels of one pixel in bytes
+inline size_t pixel_size(const EXRHeader& header) {
+    size_t size = 0;
+    for (int ci = 0; ci < header.num_channels; ci++) {
+        size += pixel_type_size(header.pixel_types[ci]);
+    }
+    return size;
+}
+
+// byte offsets of each channel inside a decoded scan line of the given width
+inline std::vector<size_t> channel_offsets(const EXRHeader& header, size_t width) {
+    std::vector<size_t> offsets(header.num_channels);
+    size_t offset = 0;
+    for (int ci = 0; ci < header.num_channels; ci++) {
+        offsets[ci] = offset;
+        offset += width * pixel_type_size(header.pixel_types[ci]);
+    }
+    return offsets;
+}
+
+// check if the image can be decoded chunk by chunk, otherwise the whole
+// image has to be loaded through tinyexr
+inline bool can_decode_chunks(const EXRHeader& header) {
+    if (lines_per_chunk(header.compression_type) == 0) {
+        return false;
+    }
+    for (int ci = 0; ci < header.num_channels; ci++) {
+        if (header.channels[ci].x_sampling > 1 || header.channels[ci].y_sampling > 1) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// read-only memory mapping of a whole file, pages are only read from disk
+// when they are accessed
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& filename) : data_(NULL), size_(0) {
+#ifdef _WIN32
+        file_ = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+                OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file_ == INVALID_HANDLE_VALUE) {
+            throw std::runtime_error("cannot open file " + filename);
+        }
+        LARGE_INTEGER size;
+        GetFileSizeEx(file_, &size);
+        size_ = (size_t) size.QuadPart;
+        mapping_ = size_ ? CreateFileMappingA(file_, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+        if (mapping_) {
+            data_ = (const unsigned char*) MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0);
+        }
+#else
+        fd_ = open(filename.c_str(), O_RDONLY);
+        if (fd_ < 0) {
+            throw std::runtime_error("cannot open file " + filename);
+        }
+        struct stat st;
+        fstat(fd_, &st);
+        size_ = (size_t) st.st_size;
+        if (size_) {
+            void* ptr = mmap(NULL, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+            data_ = ptr == MAP_FAILED ? NULL : (const unsigned char*) ptr;
+        }
+#endif
+        if (!data_) {
+            close_file();
+            throw std::runtime_error("cannot map file " + filename + ", is it empty?");
+        }
+    }
+
+    ~MappedFile() {
+#ifdef _WIN32
+        UnmapViewOfFile(data_);
+#else
+        munmap((void*) data_, size_);
+#endif
+        close_file();
+    }
+
+    const unsigned char* data() const {
+        return data_;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+private:
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+
+    void close_file() {
+#ifdef _WIN32
+        if (mapping_) {
+            CloseHandle(mapping_);
+        }
+        CloseHandle(file_);
+#else
+        close(fd_);
+#endif
+    }
+
+    const unsigned char* data_;
+    size_t size_;
+#ifdef _WIN32
+    HANDLE file_;
+    HANDLE mapping_;
+#else
+    int fd_;
+#endif
+};
+
+// OpenEXR file together with its parsed version and headers, one for each
+// part of multipart files. The file is either memory mapped, or an
+// existing buffer in memory is used, in both cases version, headers and
+// pixels are parsed from the same memory.
+class ExrFile {
+public:
+    explicit ExrFile(const std::string& filename) : mapping_(new MappedFile(filename)) {
+        data_ = mapping_->data();
+        size_ = mapping_->size();
+        parse(filename);
+    }
+
+    // the buffer must outlive this object
+    ExrFile(const unsigned char* data, size_t size) : data_(data), size_(size) {
+        parse("memory buffer");
+    }
+
+    ~ExrFile() {
+        for (size_t part = 0; part < headers_.size(); part++) {
+            FreeEXRHeader(&headers_[part]);
+        }
+    }
+
+    const unsigned char* data() const {
+        return data_;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    bool multipart() const {
+        return version_.multipart != 0;
+    }
+
+    int num_parts() const {
+        return (int) headers_.size();
+    }
+
+    EXRHeader& header(int part = 0) {
+        return headers_[part];
+    }
+
+    int width(int part = 0) const {
+        return headers_[part].data_window[2] - headers_[part].data_window[0] + 1;
+    }
+
+    int height(int part = 0) const {
+        return headers_[part].data_window[3] - headers_[part].data_window[1] + 1;
+    }
+
+    // offset table of a part, see read_offset_table()
+    void read_offsets(int part, std::vector<uint64_t>& offsets) const;
+
+private:
+    ExrFile(const ExrFile&);
+    ExrFile& operator=(const ExrFile&);
+
+    void parse(const std::string& source) {
+        if (ParseEXRVersionFromMemory(&version_, data_, size_) != TINYEXR_SUCCESS) {
+            throw std::runtime_error("Error parsing EXR version from " + source +
+                    ". Not an OpenEXR file?");
+        }
+        if (version_.non_image) {
+            throw std::runtime_error("Loading DeepImage is not supported yet.");
+        }
+        const char* err = NULL;
+        int ret;
+        if (version_.multipart) {
+            EXRHeader** headers = NULL;
+            int num_headers = 0;
+            ret = ParseEXRMultipartHeaderFromMemory(&headers, &num_headers, &version_, data_,
+                    size_, &err);
+            if (ret == TINYEXR_SUCCESS) {
+                // the headers are copied, their members are freed in the
+                // destructor
+                for (int part = 0; part < num_headers; part++) {
+                    headers_.push_back(*headers[part]);
+                    free(headers[part]);
+                }
+                free(headers);
+            }
+        } else {
+            headers_.resize(1);
+            InitEXRHeader(&headers_[0]);
+            ret = ParseEXRHeaderFromMemory(&headers_[0], &version_, data_, size_, &err);
+        }
+        if (ret != TINYEXR_SUCCESS) {
+            std::string message = err ? err : "unknown error";
+            FreeEXRErrorMessage(err);
+            throw std::runtime_error("parsing header from " + source + " failed: " + message);
+        }
+    }
+
+    std::unique_ptr<MappedFile> mapping_;
+    const unsigned char* data_;
+    size_t size_;
+    EXRVersion version_;
+    std::vector<EXRHeader> headers_;
+};
+
+inline int32_t read_int32(const unsigned char* ptr) {
+    int32_t value;
+    memcpy(&value, ptr, sizeof(value));
+    return value;
+}
+
+inline uint64_t read_uint64(const unsigned char* ptr) {
+    uint64_t value;
+    memcpy(&value, ptr, sizeof(value));
+    return value;
+}
+
+// Decompress a single block of pixels with num_lines scan lines of the
+// given width, as stored in scan line chunks and tiles. Returns a pointer
+// to the decoded data, which is either stored in buffer, or points
+// directly to src for uncompressed blocks, so that channels which are not
+// needed are never touched.
+inline const unsigned char* decompress_block(const unsigned char* src, size_t data_size,
+        const EXRHeader& header, int width, int num_lines, std::vector<unsigned char>& buffer) {
+    size_t raw_size = (size_t) num_lines * width * pixel_size(header);
+
+    // blocks that would grow by compression are stored uncompressed
+    if (header.compression_type == TINYEXR_COMPRESSIONTYPE_NONE || data_size == raw_size) {
+        if (data_size != raw_size) {
+            throw std::runtime_error("invalid size of uncompressed block");
+        }
+        return src;
+    }
+
+    buffer.resize(raw_size);
+    bool ok = true;
+    if (header.compression_type == TINYEXR_COMPRESSIONTYPE_RLE) {
+        ok = tinyexr::DecompressRle(&buffer[0], (unsigned long) raw_size, src, (unsigned long) data_size);
+    } else if (header.compression_type == TINYEXR_COMPRESSIONTYPE_ZIPS ||
+            header.compression_type == TINYEXR_COMPRESSIONTYPE_ZIP) {
+        unsigned long uncompressed_size = (unsigned long) raw_size;
+        ok = tinyexr::DecompressZip(&buffer[0], &uncompressed_size, src, (unsigned long) data_size)
+                && uncompressed_size == raw_size;
+#if TINYEXR_USE_PIZ
+    } else if (header.compression_type == TINYEXR_COMPRESSIONTYPE_PIZ) {
+        ok = tinyexr::DecompressPiz(&buffer[0], src, raw_size, data_size,
+                header.num_channels, header.channels, width, num_lines);
+#endif
+    } else {
+        throw std::runtime_error("unsupported compression type " + std::to_string(header.compression_type));
+    }
+    if (!ok) {
+        throw std::runtime_error("decompression failed");
+    }
+
+    return &buffer[0];
+}
+
+// Decompress the scan line chunk with the given index. The result is in
+// the native OpenEXR layout, i.e. for each scan line all channels are
+// stored consecutively with width samples each. The number of decoded scan
+// lines is stored in num_lines.
+inline const unsigned char* decode_chunk(const unsigned char* data, size_t size,
+        const EXRHeader& header, const std::vector<uint64_t>& offsets, size_t chunk,
+        std::vector<unsigned char>& buffer, int& num_lines) {
+    int width = header.data_window[2] - header.data_window[0] + 1;
+    int height = header.data_window[3] - header.data_window[1] + 1;
+    num_lines = lines_per_chunk(header.compression_type);
+
+    const unsigned char* chunk_ptr = data + offsets[chunk];
+    int y = read_int32(chunk_ptr) - header.data_window[1];
+    int32_t data_size = read_int32(chunk_ptr + 4);
+    if (y != (int) chunk * num_lines || data_size < 0 || offsets[chunk] + 8 + data_size > size) {
+        throw std::runtime_error("invalid chunk " + std::to_string(chunk));
+    }
+
+    num_lines = std::min(num_lines, height - y);
+    try {
+        return decompress_block(chunk_ptr + 8, data_size, header, width, num_lines, buffer);
+    } catch (std::exception& e) {
+        throw std::runtime_error(std::string(e.what()) + " in chunk " + std::to_string(chunk));
+    }
+}
+
+// tile level modes and rounding modes as stored in the tiledesc attribute
+enum { LEVEL_MODE_ONE = 0, LEVEL_MODE_MIPMAP = 1, LEVEL_MODE_RIPMAP = 2 };
+enum { ROUNDING_DOWN = 0, ROUNDING_UP = 1 };
+
+// floor(log2(x)) or ceil(log2(x)), depending on the rounding mode
+inline int round_log2(int x, int rounding_mode) {
+    int y = 0;
+    if (rounding_mode == ROUNDING_DOWN) {
+        while (x > 1) {
+            y++;
+            x >>= 1;
+        }
+    } else {
+        while ((1 << y) < x) {
+            y++;
+        }
+    }
+    return y;
+}
+
+// size of a tiled image along one dimension at the given level
+inline int level_size(int size, int level, int rounding_mode) {
+    if (rounding_mode == ROUNDING_UP) {
+        size += (1 << level) - 1;
+    }
+    return std::max(1, size >> level);
+}
+
+// number of resolution levels of an image along x and y
+inline void num_levels(const EXRHeader& header, int& num_levels_x, int& num_levels_y) {
+    int width = header.data_window[2] - header.data_window[0] + 1;
+    int height = header.data_window[3] - header.data_window[1] + 1;
+    num_levels_x = 1;
+    num_levels_y = 1;
+    if (!header.tiled) {
+        return;
+    }
+    if (header.tile_level_mode == LEVEL_MODE_MIPMAP) {
+        num_levels_x = round_log2(std::max(width, height), header.tile_rounding_mode) + 1;
+        num_levels_y = num_levels_x;
+    } else if (header.tile_level_mode == LEVEL_MODE_RIPMAP) {
+        num_levels_x = round_log2(width, header.tile_rounding_mode) + 1;
+        num_levels_y = round_log2(height, header.tile_rounding_mode) + 1;
+    }
+}
+
+// Index of the first tile of a level in the offset table of a tiled image.
+// The levels are stored in increasing order, with level_x running fastest
+// for rip maps, and the tiles of each level in row-major order.
+inline size_t first_tile(const EXRHeader& header, int level_x, int level_y) {
+    int width = header.data_window[2] - header.data_window[0] + 1;
+    int height = header.data_window[3] - header.data_window[1] + 1;
+    int num_levels_x, num_levels_y;
+    num_levels(header, num_levels_x, num_levels_y);
+    size_t index = 0;
+    for (int ly = 0; ly < num_levels_y; ly++) {
+        for (int lx = 0; lx < num_levels_x; lx++) {
+            if (header.tile_level_mode != LEVEL_MODE_RIPMAP && lx != ly) {
+                continue;
+            }
+            if (lx == level_x && ly == level_y) {
+                return index;
+            }
+            int level_width = level_size(width, lx, header.tile_rounding_mode);
+            int level_height = level_size(height, ly, header.tile_rounding_mode);
+            index += (size_t) ((level_width + header.tile_size_x - 1) / header.tile_size_x) *
+                    ((level_height + header.tile_size_y - 1) / header.tile_size_y);
+        }
+    }
+    return index;
+}
+
+// number of chunks of a part, i.e. of blocks of scan lines or of tiles of
+// all levels
+inline size_t num_chunks(const EXRHeader& header) {
+    if (header.tiled) {
+        // index of the first tile after the last level
+        int num_levels_x, num_levels_y;
+        num_levels(header, num_levels_x, num_levels_y);
+        return first_tile(header, num_levels_x, num_levels_y);
+    }
+    int height = header.data_window[3] - header.data_window[1] + 1;
+    int num_lines = lines_per_chunk(header.compression_type);
+    return (height + num_lines - 1) / num_lines;
+}
+
+// Read num_chunks entries of the offset table at table_start. In multipart
+// files, every chunk starts with the index of its part, which is checked
+// and skipped, so that the offsets point to the same chunk layout as in
+// single part files; part is negative for single part files.
+inline void read_offset_table(const unsigned char* data, size_t size, size_t table_start,
+        size_t num_chunks, int part, std::vector<uint64_t>& offsets) {
+    if (table_start + num_chunks * sizeof(uint64_t) > size) {
+        throw std::runtime_error("offset table exceeds file size");
+    }
+    offsets.resize(num_chunks);
+    for (size_t ii = 0; ii < num_chunks; ii++) {
+        offsets[ii] = read_uint64(data + table_start + ii * sizeof(uint64_t));
+        if (part >= 0) {
+            if (offsets[ii] + 4 > size || read_int32(data + offsets[ii]) != part) {
+                throw std::runtime_error("invalid chunk offset or part number, file is possibly truncated");
+            }
+            offsets[ii] += 4;
+        }
+        if (offsets[ii] + 8 > size) {
+            throw std::runtime_error("invalid chunk offset, file is possibly truncated");
+        }
+    }
+}
+
+// Offset table of a single part image. The table directly follows the
+// header, whose length (excluding magic number and version field) is
+// provided by tinyexr.
+inline void read_offsets(const unsigned char* data, size_t size, const EXRHeader& header,
+        std::vector<uint64_t>& offsets) {
+    read_offset_table(data, size, 8 + (size_t) header.header_len, num_chunks(header), -1, offsets);
+}
+
+// position after the header starting at position, which is a sequence of
+// attributes (name, type, size and value) terminated by a null byte
+inline size_t skip_header(const unsigned char* data, size_t size, size_t position) {
+    while (position < size && data[position] != 0) {
+        for (int ii = 0; ii < 2; ii++) {
+            const void* end = memchr(data + position, 0, size - position);
+            if (!end) {
+                throw std::runtime_error("invalid header, file is possibly truncated");
+            }
+            position = (const unsigned char*) end - data + 1;
+        }
+        if (position + 4 > size || read_int32(data + position) < 0) {
+            throw std::runtime_error("invalid header, file is possibly truncated");
+        }
+        position += 4 + read_int32(data + position);
+    }
+    if (position >= size) {
+        throw std::runtime_error("invalid header, file is possibly truncated");
+    }
+    return position + 1;
+}
+
+// The headers of all parts of a multipart file are followed by a null byte
+// and the offset tables of all parts in the same order.
+inline void ExrFile::read_offsets(int part, std::vector<uint64_t>& offsets) const {
+    if (!multipart()) {
+        exr_chunks::read_offsets(data_, size_, headers_[0], offsets);
+        return;
+    }
+    size_t table_start = 8;
+    for (size_t pi = 0; pi < headers_.size(); pi++) {
+        table_start = skip_header(data_, size_, table_start);
+    }
+    table_start++;
+    for (int pi = 0; pi < part; pi++) {
+        table_start += num_chunks(headers_[pi]) * sizeof(uint64_t);
+    }
+    read_offset_table(data_, size_, table_start, num_chunks(headers_[part]), part, offsets);
+}
+
+// Decompress the tile (tile_x, tile_y) of the given level, the result is
+// in the same layout as for scan line chunks with the actual width and
+// height of the tile, which are smaller than the tile size at the right
+// and bottom borders.
+inline const unsigned char* decode_tile(const unsigned char* data, size_t size,
+        const EXRHeader& header, uint64_t offset, int tile_x, int tile_y, int level_x,
+        int level_y, int tile_width, int tile_height, std::vector<unsigned char>& buffer) {
+    if (offset + 20 > size) {
+        throw std::runtime_error("invalid tile offset, file is possibly truncated");
+    }
+    const unsigned char* tile_ptr = data + offset;
+    int32_t data_size = read_int32(tile_ptr + 16);
+    if (read_int32(tile_ptr) != tile_x || read_int32(tile_ptr + 4) != tile_y ||
+            read_int32(tile_ptr + 8) != level_x || read_int32(tile_ptr + 12) != level_y ||
+            data_size < 0 || offset + 20 + data_size > size) {
+        throw std::runtime_error("invalid tile (" + std::to_string(tile_x) + ", " +
+                std::to_string(tile_y) + ") at level (" + std::to_string(level_x) + ", " +
+                std::to_string(level_y) + ")");
+    }
+    try {
+        return decompress_block(tile_ptr + 20, data_size, header, tile_width, tile_height, buffer);
+    } catch (std::exception& e) {
+        throw std::runtime_error(std::string(e.what()) + " in tile (" + std::to_string(tile_x) +
+                ", " + std::to_string(tile_y) + ")");
+    }
+}
+
+// conversion of a single sample from the pixel type stored in the file to
+// the output type, half precision floats are represented as uint16_t
+template <typename T>
+inline T convert_sample(const unsigned char* src, int src_type);
+
+template <>
+inline float convert_sample<float>(const unsigned char* src, int src_type) {
+    if (src_type == TINYEXR_PIXELTYPE_HALF) {
+        tinyexr::FP16 h;
+        memcpy(&h.u, src, 2);
+        return tinyexr::half_to_float(h).f;
+    } else if (src_type == TINYEXR_PIXELTYPE_FLOAT) {
+        float f;
+        memcpy(&f, src, 4);
+        return f;
+    } else {
+        uint32_t u;
+        memcpy(&u, src, 4);
+        return (float) u;
+    }
+}
+
+template <>
+inline uint16_t convert_sample<uint16_t>(const unsigned char* src, int src_type) {
+    if (src_type == TINYEXR_PIXELTYPE_HALF) {
+        uint16_t h;
+        memcpy(&h, src, 2);
+        return h;
+    }
+    tinyexr::FP32 f;
+    f.f = convert_sample<float>(src, src_type);
+    return tinyexr::float_to_half_full(f).u;
+}
+
+template <>
+inline uint32_t convert_sample<uint32_t>(const unsigned char* src, int src_type) {
+    if (src_type == TINYEXR_PIXELTYPE_UINT) {
+        uint32_t u;
+        memcpy(&u, src, 4);
+        return u;
+    }
+    float f = convert_sample<float>(src, src_type);
+    return f > 0.f ? (uint32_t) f : 0;
+}
+
+template <>
+inline double convert_sample<double>(const unsigned char* src, int src_type) {
+    if (src_type == TINYEXR_PIXELTYPE_UINT) {
+        uint32_t u;
+        memcpy(&u, src, 4);
+        return (double) u;
+    }
+    return (double) convert_sample<float>(src, src_type);
+}
+
+// Vectorized conversion of half precision floats using the F16C
+// instructions. The kernels are compiled for the corresponding target even
+// if the rest of the MEX file is not, and are only called after checking
+// that the CPU supports them.
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define EXR_CHUNKS_F16C __attribute__((target("avx,f16c")))
+inline bool cpu_has_f16c() {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx") && __builtin_cpu_supports("f16c");
+}
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#define EXR_CHUNKS_F16C
+inline bool cpu_has_f16c() {
+    int info[4];
+    __cpuid(info, 1);
+    // OSXSAVE, AVX & F16C flags
+    return (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (info[2] & (1 << 29));
+}
+#endif
+
+#ifdef EXR_CHUNKS_F16C
+EXR_CHUNKS_F16C
+inline void half_to_float_f16c(const unsigned char* src, float* dst, size_t n) {
+    size_t ii = 0;
+    for (; ii + 8 <= n; ii += 8) {
+        __m128i h = _mm_loadu_si128((const __m128i*) (src + 2 * ii));
+        _mm256_storeu_ps(dst + ii, _mm256_cvtph_ps(h));
+    }
+    for (; ii < n; ii++) {
+        dst[ii] = convert_sample<float>(src + 2 * ii, TINYEXR_PIXELTYPE_HALF);
+    }
+}
+
+EXR_CHUNKS_F16C
+inline void half_to_double_f16c(const unsigned char* src, double* dst, size_t n) {
+    size_t ii = 0;
+    for (; ii + 8 <= n; ii += 8) {
+        __m256 f = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*) (src + 2 * ii)));
+        _mm256_storeu_pd(dst + ii, _mm256_cvtps_pd(_mm256_castps256_ps128(f)));
+        _mm256_storeu_pd(dst + ii + 4, _mm256_cvtps_pd(_mm256_extractf128_ps(f, 1)));
+    }
+    for (; ii < n; ii++) {
+        dst[ii] = convert_sample<double>(src + 2 * ii, TINYEXR_PIXELTYPE_HALF);
+    }
+}
+
+// conversion to half precision floats with rounding to the nearest value,
+// used when writing
+EXR_CHUNKS_F16C
+inline void float_to_half_f16c(const unsigned char* src, unsigned char* dst, size_t n) {
+    size_t ii = 0;
+    for (; ii + 8 <= n; ii += 8) {
+        __m128i h = _mm256_cvtps_ph(_mm256_loadu_ps((const float*) (src + 4 * ii)),
+                _MM_FROUND_TO_NEAREST_INT);
+        _mm_storeu_si128((__m128i*) (dst + 2 * ii), h);
+    }
+    for (; ii < n; ii++) {
+        uint16_t h = convert_sample<uint16_t>(src + 4 * ii, TINYEXR_PIXELTYPE_FLOAT);
+        memcpy(dst + 2 * ii, &h, 2);
+    }
+}
+#endif
+
+// convert n samples of a scan line starting at src, taking every stride-th
+// sample
+template <typename T>
+inline void convert_row(const unsigned char* src, int src_type, int stride, size_t n, T* dst) {
+    const size_t step = stride * pixel_type_size(src_type);
+    for (size_t ii = 0; ii < n; ii++) {
+        dst[ii] = convert_sample<T>(src + ii * step, src_type);
+    }
+}
+
+inline void convert_row(const unsigned char* src, int src_type, int stride, size_t n, float* dst) {
+#ifdef EXR_CHUNKS_F16C
+    static const bool has_f16c = cpu_has_f16c();
+    if (has_f16c && src_type == TINYEXR_PIXELTYPE_HALF && stride == 1) {
+        half_to_float_f16c(src, dst, n);
+        return;
+    }
+#endif
+    convert_row<float>(src, src_type, stride, n, dst);
+}
+
+inline void convert_row(const unsigned char* src, int src_type, int stride, size_t n, double* dst) {
+#ifdef EXR_CHUNKS_F16C
+    static const bool has_f16c = cpu_has_f16c();
+    if (has_f16c && src_type == TINYEXR_PIXELTYPE_HALF && stride == 1) {
+        half_to_double_f16c(src, dst, n);
+        return;
+    }
+#endif
+    convert_row<double>(src, src_type, stride, n, dst);
+}
+
+// part of the image that should be read: resolution level of tiled images,
+// region of interest [x_min, y_min, x_max, y_max] relative to the data
+// window at that level, step sizes along x and y and the indices of the
+// requested channels; if average is set, each output pixel is the mean of
+// the stride_x x stride_y block of pixels starting at its position instead
+// of only this first pixel
+struct ReadRequest {
+    int level_x;
+    int level_y;
+    int roi[4];
+    int stride_x;
+    int stride_y;
+    bool average;
+    std::vector<size_t> channel_mask;
+
+    size_t width_out() const {
+        return (roi[2] - roi[0]) / stride_x + 1;
+    }
+
+    size_t height_out() const {
+        return (roi[3] - roi[1]) / stride_y + 1;
+    }
+};
+
+// number of scan lines that are transposed together into the output array
+const int band_height = 32;
+
+// number of output columns that are converted at once per scan line
+const size_t band_width = 256;
+
+// Area-averaging counterpart of write_band(): every output pixel whose
+// block starts inside the band is set to the mean of its block, blocks at
+// the borders of the region of interest are averaged over the pixels
+// inside of it. The band must hold all scan lines of these blocks. Scan
+// lines are converted to single precision and summed up in place, so the
+// full resolution image is never stored.
+template <typename T>
+inline void write_band_average(const unsigned char* const* rows, const int* pixel_types,
+        int x_first, int y_first, int num_lines, const ReadRequest& request, T* out) {
+    const size_t width_out = request.width_out();
+    const size_t height_out = request.height_out();
+    const size_t num_channels_out = request.channel_mask.size();
+    const int width_roi = request.roi[2] - request.roi[0] + 1;
+
+    // output rows whose blocks start in this band
+    const int y_out_begin = std::max(0, (y_first - request.roi[1] + request.stride_y - 1) / request.stride_y);
+    const int y_out_end = std::min((int) height_out,
+            (y_first + num_lines - request.roi[1] + request.stride_y - 1) / request.stride_y);
+
+    std::vector<float> line(width_roi);
+    std::vector<float> sums(width_out);
+    for (size_t ci_out = 0; ci_out < num_channels_out; ci_out++) {
+        const int pixel_type = pixel_types[ci_out];
+        const size_t x_offset = (request.roi[0] - x_first) * pixel_type_size(pixel_type);
+        T* out_channel = out + ci_out * height_out * width_out;
+        for (int y_out = y_out_begin; y_out < y_out_end; y_out++) {
+            const int y_begin = request.roi[1] + y_out * request.stride_y;
+            const int y_end = std::min(request.roi[3] + 1, y_begin + request.stride_y);
+            std::fill(sums.begin(), sums.end(), 0.f);
+            for (int y = y_begin; y < y_end; y++) {
+                convert_row(rows[(y - y_first) * num_channels_out + ci_out] + x_offset,
+                        pixel_type, 1, width_roi, &line[0]);
+                for (size_t x_out = 0; x_out < width_out; x_out++) {
+                    const int x_end = std::min(width_roi, (int) (x_out + 1) * request.stride_x);
+                    float sum = 0.f;
+                    for (int x = x_out * request.stride_x; x < x_end; x++) {
+                        sum += line[x];
+                    }
+                    sums[x_out] += sum;
+                }
+            }
+            for (size_t x_out = 0; x_out < width_out; x_out++) {
+                const int block_width = std::min(width_roi, (int) (x_out + 1) * request.stride_x) -
+                        (int) x_out * request.stride_x;
+                const float mean = sums[x_out] / (block_width * (y_end - y_begin));
+                out_channel[x_out * height_out + y_out] = convert_sample<T>(
+                        (const unsigned char*) &mean, TINYEXR_PIXELTYPE_FLOAT);
+            }
+        }
+    }
+}
+
+// Write a horizontal band of scan lines [y_first, y_first + num_lines)
+// to the column-major Matlab array out of size height_out x width_out x
+// num_channels_out. rows[yi * num_channels_out + ci_out] points to the
+// sample in column x_first of the requested channel ci_out in scan line
+// y_first + yi. The band is processed in blocks of band_width columns:
+// the scan line segments of a block are converted with vectorized kernels
+// where possible, then transposed, so that every output column receives
+// the samples of all scan lines of the band in consecutive memory
+// locations. Area-averaged requests are passed on to write_band_average().
+template <typename T>
+inline void write_band(const unsigned char* const* rows, const int* pixel_types,
+        int x_first, int y_first, int num_lines, const ReadRequest& request, T* out) {
+    if (request.average) {
+        write_band_average(rows, pixel_types, x_first, y_first, num_lines, request, out);
+        return;
+    }
+
+    const size_t width_out = request.width_out();
+    const size_t height_out = request.height_out();
+    const size_t num_channels_out = request.channel_mask.size();
+
+    // scan lines of the band that end up in the output
+    std::vector<int> lines;
+    for (int yi = 0; yi < num_lines; yi++) {
+        int y = y_first + yi;
+        if (y >= request.roi[1] && y <= request.roi[3] && (y - request.roi[1]) % request.stride_y == 0) {
+            lines.push_back(yi);
+        }
+    }
+    if (lines.empty()) {
+        return;
+    }
+    const size_t y_out_first = (y_first + lines[0] - request.roi[1]) / request.stride_y;
+
+    std::vector<T> block(lines.size() * band_width);
+    for (size_t ci_out = 0; ci_out < num_channels_out; ci_out++) {
+        const int pixel_type = pixel_types[ci_out];
+        const size_t sample_size = pixel_type_size(pixel_type);
+        T* out_channel = out + ci_out * height_out * width_out + y_out_first;
+        for (size_t x_begin = 0; x_begin < width_out; x_begin += band_width) {
+            const size_t n = std::min(band_width, width_out - x_begin);
+            const size_t x_offset = (request.roi[0] - x_first + x_begin * request.stride_x) * sample_size;
+            for (size_t li = 0; li < lines.size(); li++) {
+                convert_row(rows[lines[li] * num_channels_out + ci_out] + x_offset,
+                        pixel_type, request.stride_x, n, &block[li * band_width]);
+            }
+            for (size_t xi = 0; xi < n; xi++) {
+                T* out_column = out_channel + (x_begin + xi) * height_out;
+                for (size_t li = 0; li < lines.size(); li++) {
+                    out_column[li] = block[li * band_width + xi];
+                }
+            }
+        }
+    }
+}
+
+// Resolve a read request against the image header. roi may be NULL to
+// read the whole data window, negative x_min / y_min are clamped to 0 and
+// negative x_max / y_max are counted from the end, i.e. -1 is the last
+// column / row. strides may be NULL for reading every pixel, and an empty
+// channel_mask (given as 0-based indices) selects all channels. level
+// holds [level_x, level_y] of a mip or rip mapped image, or is NULL for
+// the full resolution level; roi refers to the pixels at that level.
+inline ReadRequest make_request(const EXRHeader& header, const double* roi,
+        const double* strides, const double* channel_mask, size_t num_channels_mask,
+        const double* level = NULL) {
+    ReadRequest request;
+    request.average = false;
+    request.level_x = level ? (int) level[0] : 0;
+    request.level_y = level ? (int) level[1] : 0;
+    int num_levels_x, num_levels_y;
+    num_levels(header, num_levels_x, num_levels_y);
+    if (request.level_x < 0 || request.level_x >= num_levels_x ||
+            request.level_y < 0 || request.level_y >= num_levels_y ||
+            (header.tiled && header.tile_level_mode == LEVEL_MODE_MIPMAP &&
+                request.level_x != request.level_y)) {
+        char buffer[1000];
+        sprintf(buffer, "invalid level [%d, %d], the image has %d x %d levels%s.",
+                request.level_x, request.level_y, num_levels_x, num_levels_y,
+                header.tiled && header.tile_level_mode == LEVEL_MODE_MIPMAP ? " (mip map)" : "");
+        throw std::runtime_error(buffer);
+    }
+
+    int rounding_mode = header.tiled ? header.tile_rounding_mode : ROUNDING_DOWN;
+    const int width = level_size(header.data_window[2] - header.data_window[0] + 1,
+            request.level_x, rounding_mode);
+    const int height = level_size(header.data_window[3] - header.data_window[1] + 1,
+            request.level_y, rounding_mode);
+
+    request.roi[0] = 0;
+    request.roi[1] = 0;
+    request.roi[2] = width - 1;
+    request.roi[3] = height - 1;
+    if (roi) {
+        request.roi[0] = std::max(0, (int) roi[0]);
+        request.roi[1] = std::max(0, (int) roi[1]);
+        request.roi[2] = roi[2] < 0 ? width + (int) roi[2] : (int) roi[2];
+        request.roi[3] = roi[3] < 0 ? height + (int) roi[3] : (int) roi[3];
+        if (request.roi[0] > request.roi[2] || request.roi[1] > request.roi[3] ||
+                request.roi[2] >= width || request.roi[3] >= height) {
+            char buffer[1000];
+            sprintf(buffer, "region of interest out of image bounds: given roi: [%d, %d, %d, %d], img: [%d x %d x %d].",
+                    request.roi[0], request.roi[1], request.roi[2], request.roi[3],
+                    width, height, header.num_channels);
+            throw std::runtime_error(buffer);
+        }
+    }
+
+    request.stride_x = strides ? (int) strides[0] : 1;
+    request.stride_y = strides ? (int) strides[1] : 1;
+    if (request.stride_x < 1 || request.stride_y < 1) {
+        throw std::runtime_error("strides must be positive integers.");
+    }
+
+    if (channel_mask && num_channels_mask) {
+        request.channel_mask.resize(num_channels_mask);
+        for (size_t ci_out = 0; ci_out < num_channels_mask; ci_out++) {
+            if (channel_mask[ci_out] < 0 || channel_mask[ci_out] >= header.num_channels) {
+                throw std::runtime_error("channel_mask contains invalid channel indices.");
+            }
+            request.channel_mask[ci_out] = (size_t) channel_mask[ci_out];
+        }
+    } else {
+        request.channel_mask.resize(header.num_channels);
+        for (int ci = 0; ci < header.num_channels; ci++) {
+            request.channel_mask[ci] = ci;
+        }
+    }
+
+    return request;
+}
+
+// Split the scan lines of the region of interest into bands [limits[i],
+// limits[i + 1]) that are decoded independently. Point sampled bands are
+// aligned to the blocks of block_height scan lines in which the image is
+// stored (chunks or rows of tiles). Area-averaged bands hold whole rows of
+// averaging blocks instead, file blocks crossing band borders are then
+// decoded for both bands.
+inline std::vector<int> band_limits(const ReadRequest& request, int block_height) {
+    int y, step;
+    if (request.average) {
+        y = request.roi[1];
+        step = std::max(1, band_height / request.stride_y) * request.stride_y;
+    } else {
+        y = request.roi[1] / block_height * block_height;
+        step = std::max(1, band_height / block_height) * block_height;
+    }
+    std::vector<int> limits;
+    for (; y <= request.roi[3]; y += step) {
+        limits.push_back(y);
+    }
+    limits.push_back(request.roi[3] + 1);
+    return limits;
+}
+
+// pixel types stored in the file for each requested channel
+inline std::vector<int> pixel_types_out(const EXRHeader& header, const ReadRequest& request) {
+    std::vector<int> pixel_types(request.channel_mask.size());
+    for (size_t ci_out = 0; ci_out < pixel_types.size(); ci_out++) {
+        pixel_types[ci_out] = header.pixel_types[request.channel_mask[ci_out]];
+    }
+    return pixel_types;
+}
+
+// Decode the requested part of a tiled image at the requested level. The
+// region of interest is split into bands by band_limits(), for each band
+// only the tiles overlapping the region are decompressed, and the
+// requested channels are gathered into a band buffer from which the output
+// is written.
+template <typename T>
+inline void read_tiles(const unsigned char* data, size_t size, const EXRHeader& header,
+        const std::vector<uint64_t>& offsets, const ReadRequest& request, T* out) {
+    const std::vector<int> pixel_types = pixel_types_out(header, request);
+    const int width = level_size(header.data_window[2] - header.data_window[0] + 1,
+            request.level_x, header.tile_rounding_mode);
+    const int height = level_size(header.data_window[3] - header.data_window[1] + 1,
+            request.level_y, header.tile_rounding_mode);
+    const int tile_size_x = header.tile_size_x;
+    const int tile_size_y = header.tile_size_y;
+    const int num_tiles_x = (width + tile_size_x - 1) / tile_size_x;
+    const int num_tiles_y = (height + tile_size_y - 1) / tile_size_y;
+    const int tile_x_first = request.roi[0] / tile_size_x;
+    const int tile_x_last = request.roi[2] / tile_size_x;
+    const size_t num_channels_out = request.channel_mask.size();
+    const size_t line_size = pixel_size(header);
+
+    const size_t tile_index = first_tile(header, request.level_x, request.level_y);
+    if (tile_index + (size_t) num_tiles_x * num_tiles_y > offsets.size()) {
+        throw std::runtime_error("offset table too short");
+    }
+
+    // the band buffer covers the columns of all tiles overlapping the
+    // region of interest, with the requested channels stored one after the
+    // other for each scan line
+    const int x_first = tile_x_first * tile_size_x;
+    const int band_columns = std::min(width, (tile_x_last + 1) * tile_size_x) - x_first;
+    std::vector<size_t> offsets_out(num_channels_out);
+    size_t band_line_size = 0;
+    for (size_t ci_out = 0; ci_out < num_channels_out; ci_out++) {
+        offsets_out[ci_out] = band_line_size;
+        band_line_size += band_columns * pixel_type_size(pixel_types[ci_out]);
+    }
+
+    const std::vector<int> limits = band_limits(request, tile_size_y);
+    const int num_bands = (int) limits.size() - 1;
+
+    std::string error;
+    #pragma omp parallel
+    {
+        std::vector<unsigned char> buffer;
+        std::vector<unsigned char> band;
+        std::vector<const unsigned char*> rows;
+        #pragma omp for schedule(dynamic)
+        for (int band_index = 0; band_index < num_bands; band_index++) {
+            try {
+                const int y_begin = limits[band_index];
+                const int y_end = limits[band_index + 1];
+                band.resize((y_end - y_begin) * band_line_size);
+                rows.resize((y_end - y_begin) * num_channels_out);
+                for (int tile_y = y_begin / tile_size_y; tile_y <= (y_end - 1) / tile_size_y; tile_y++) {
+                    // scan lines of this row of tiles that lie inside the band
+                    const int y_tile = tile_y * tile_size_y;
+                    const int tile_height = std::min(tile_size_y, height - y_tile);
+                    const int yi_begin = std::max(y_begin, y_tile) - y_tile;
+                    const int yi_end = std::min(y_end, y_tile + tile_height) - y_tile;
+                    for (int tile_x = tile_x_first; tile_x <= tile_x_last; tile_x++) {
+                        const int tile_width = std::min(tile_size_x, width - tile_x * tile_size_x);
+                        const uint64_t offset =
+                                offsets[tile_index + (size_t) tile_y * num_tiles_x + tile_x];
+                        const unsigned char* tile_data = decode_tile(data, size, header, offset,
+                                tile_x, tile_y, request.level_x, request.level_y, tile_width,
+                                tile_height, buffer);
+                        const std::vector<size_t> offsets_tile = channel_offsets(header, tile_width);
+                        for (int yi = yi_begin; yi < yi_end; yi++) {
+                            for (size_t ci_out = 0; ci_out < num_channels_out; ci_out++) {
+                                const size_t sample_size = pixel_type_size(pixel_types[ci_out]);
+                                memcpy(&band[(y_tile + yi - y_begin) * band_line_size + offsets_out[ci_out] +
+                                            (tile_x * tile_size_x - x_first) * sample_size],
+                                        tile_data + yi * tile_width * line_size +
+                                            offsets_tile[request.channel_mask[ci_out]],
+                                        tile_width * sample_size);
+                            }
+                        }
+                    }
+                }
+                for (int yi = 0; yi < y_end - y_begin; yi++) {
+                    for (size_t ci_out = 0; ci_out < num_channels_out; ci_out++) {
+                        rows[yi * num_channels_out + ci_out] = &band[yi * band_line_size + offsets_out[ci_out]];
+                    }
+                }
+                write_band(&rows[0], &pixel_types[0], x_first, y_begin, y_end - y_begin, request, out);
+            } catch (std::exception& e) {
+                #pragma omp critical
+                error = e.what();
+            }
+        }
+    }
+    if (!error.empty()) {
+        throw std::runtime_error(error);
+    }
+}
+
+// Decode the requested part of a scan line image, given the offset table
+// read by read_offsets(). Only chunks overlapping the region of interest
+// are decompressed, the bands given by band_limits() are processed in
+// parallel.
+template <typename T>
+inline void read_scanlines(const unsigned char* data, size_t size, const EXRHeader& header,
+        const std::vector<uint64_t>& offsets, const ReadRequest& request, T* out) {
+    const size_t width = header.data_window[2] - header.data_window[0] + 1;
+    const size_t num_channels_out = request.channel_mask.size();
+    const std::vector<int> pixel_types = pixel_types_out(header, request);
+    const std::vector<size_t> offsets_channels = channel_offsets(header, width);
+    const size_t line_size = width * pixel_size(header);
+    const int lines_per_chunk = exr_chunks::lines_per_chunk(header.compression_type);
+    const std::vector<int> limits = band_limits(request, lines_per_chunk);
+    const int num_bands = (int) limits.size() - 1;
+
+    std::string error;
+    #pragma omp parallel
+    {
+        std::vector<std::vector<unsigned char> > buffers;
+        std::vector<const unsigned char*> rows;
+        #pragma omp for schedule(dynamic)
+        for (int band = 0; band < num_bands; band++) {
+            try {
+                const int y_begin = limits[band];
+                const int y_end = limits[band + 1];
+                const int chunk_begin = y_begin / lines_per_chunk;
+                const int chunk_end = (y_end - 1) / lines_per_chunk + 1;
+                buffers.resize(std::max(buffers.size(), (size_t) (chunk_end - chunk_begin)));
+                rows.resize((y_end - y_begin) * num_channels_out);
+                for (int chunk = chunk_begin; chunk < chunk_end; chunk++) {
+                    int num_lines;
+                    const unsigned char* chunk_data = decode_chunk(data, size, header, offsets,
+                            chunk, buffers[chunk - chunk_begin], num_lines);
+                    for (int yi = 0; yi < num_lines; yi++) {
+                        const int y = chunk * lines_per_chunk + yi;
+                        if (y < y_begin || y >= y_end) {
+                            continue;
+                        }
+                        for (size_t ci_out = 0; ci_out < num_channels_out; ci_out++) {
+                            rows[(y - y_begin) * num_channels_out + ci_out] = chunk_data +
+                                    yi * line_size + offsets_channels[request.channel_mask[ci_out]];
+                        }
+                    }
+                }
+                write_band(&rows[0], &pixel_types[0], 0, y_begin, y_end - y_begin, request, out);
+            } catch (std::exception& e) {
+                #pragma omp critical
+                error = e.what();
+            }
+        }
+    }
+    if (!error.empty()) {
+        throw std::runtime_error(error);
+    }
+}
+
+// Frees the pixels of an image loaded by tinyexr when going out of scope,
+// also if decoding throws.
+class ExrImageGuard {
+public:
+    explicit ExrImageGuard(EXRImage* image) : image_(image) {}
+
+    ~ExrImageGuard() {
+        FreeEXRImage(image_);
+    }
+
+private:
+    ExrImageGuard(const ExrImageGuard&);
+    ExrImageGuard& operator=(const ExrImageGuard&);
+
+    EXRImage* image_;
+};
+
+// Decode the requested part of the image directly into the column-major
+// Matlab array out, without ever storing the complete image. Scan line
+// and tiled images are decoded chunk by chunk, if the image cannot be
+// decoded this way, tinyexr is used to load the whole image first.
+template <typename T>
+inline void read_pixels(const unsigned char* data, size_t size, EXRHeader& header,
+        const ReadRequest& request, T* out) {
+    if (!can_decode_chunks(header)) {
+        if (header.tiled) {
+            throw std::runtime_error("compression type " + std::to_string(header.compression_type) +
+                    " is not supported for tiled images.");
+        }
+        const size_t width = header.data_window[2] - header.data_window[0] + 1;
+        const size_t num_channels_out = request.channel_mask.size();
+        const std::vector<int> pixel_types = pixel_types_out(header, request);
+        // keep the stored pixel types, conversion happens in write_band()
+        for (int ci = 0; ci < header.num_channels; ci++) {
+            header.requested_pixel_types[ci] = header.pixel_types[ci];
+        }
+        EXRImage image;
+        InitEXRImage(&image);
+        const char* err = NULL;
+        if (LoadEXRImageFromMemory(&image, &header, data, size, &err) != TINYEXR_SUCCESS) {
+            std::string message = err ? err : "unknown error";
+            FreeEXRErrorMessage(err);
+            throw std::runtime_error("Load EXR error: " + message);
+        }
+        ExrImageGuard image_guard(&image);
+        const int num_lines = request.roi[3] - request.roi[1] + 1;
+        std::vector<const unsigned char*> rows(num_lines * num_channels_out);
+        for (int yi = 0; yi < num_lines; yi++) {
+            for (size_t ci_out = 0; ci_out < num_channels_out; ci_out++) {
+                rows[yi * num_channels_out + ci_out] = image.images[request.channel_mask[ci_out]] +
+                        (request.roi[1] + yi) * width * pixel_type_size(pixel_types[ci_out]);
+            }
+        }
+        write_band(&rows[0], &pixel_types[0], 0, request.roi[1], num_lines, request, out);
+        return;
+    }
+
+    std::vector<uint64_t> offsets;
+    read_offsets(data, size, header, offsets);
+    if (header.tiled) {
+        read_tiles(data, size, header, offsets, request, out);
+    } else {
+        read_scanlines(data, size, header, offsets, request, out);
+    }
+}
+
+// read the pixels of a part of file, parts of multipart files can only be
+// decoded chunk-wise
+template <typename T>
+inline void read_pixels(ExrFile& file, const ReadRequest& request, T* out, int part = 0) {
+    if (!file.multipart()) {
+        read_pixels(file.data(), file.size(), file.header(), request, out);
+        return;
+    }
+    const EXRHeader& header = file.header(part);
+    if (!can_decode_chunks(header)) {
+        throw std::runtime_error("compression type " + std::to_string(header.compression_type) +
+                " is not supported for multipart files.");
+    }
+    std::vector<uint64_t> offsets;
+    file.read_offsets(part, offsets);
+    if (header.tiled) {
+        read_tiles(file.data(), file.size(), header, offsets, request, out);
+    } else {
+        read_scanlines(file.data(), file.size(), header, offsets, request, out);
+    }
+}
+
+} // namespace exr_chunks
+
+#endif // EXR_CHUNKS_H
@@ -0,0 +1,900 @@
+/**************************************************************************
+ * Copyright 2026 Sebastian Merzbach
+ *
+ * authors:
+ *  - Sebastian Merzbach <smerzbach@gmail.com>
+ *
+ * file creation date: 2026-10-16
+ *
+ * This file is part of smml.
+ *
+ * smml is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * smml is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with smml.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ **************************************************************************
+ *
+ * Parallel encoder for OpenEXR files. Header and offset table are written
+ * here, while the chunks of scan lines or tiles are compressed concurrently
+ * with the compression routines of tinyexr, so exr_chunks.h and tinyexr.h
+ * (with TINYEXR_IMPLEMENTATION defined) have to be included before this
+ * header. Mip and rip map levels of tiled images are computed by box
+ * filtering the previous level. Errors are reported by throwing
+ * std::runtime_error.
+ */
+
+#ifndef EXR_ENCODE_H
+#define EXR_ENCODE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace exr_chunks {
+
+// layout of an image to be written: resolution, channel names (which have
+// to be sorted alphabetically), pixel types as stored in the file,
+// compression type, for tiled images tile size and level structure, and
+// for parts of multipart files their unique name and index (which is set by
+// write_file(), -1 denotes single part files)
+struct WriteLayout {
+    WriteLayout() : width(0), height(0), compression(TINYEXR_COMPRESSIONTYPE_NONE),
+            tiled(false), tile_size_x(0), tile_size_y(0), level_mode(LEVEL_MODE_ONE),
+            rounding_mode(ROUNDING_DOWN), part(-1) {}
+
+    int width;
+    int height;
+    std::vector<std::string> channel_names;
+    std::vector<int> pixel_types;
+    int compression;
+    bool tiled;
+    int tile_size_x;
+    int tile_size_y;
+    int level_mode;
+    int rounding_mode;
+    std::string part_name;
+    int part;
+
+    size_t pixel_size() const {
+        size_t size = 0;
+        for (size_t ci = 0; ci < pixel_types.size(); ci++) {
+            size += pixel_type_size(pixel_types[ci]);
+        }
+        return size;
+    }
+};
+
+// destination of an encoded file, positions are relative to the start of
+// the file
+class Sink {
+public:
+    virtual ~Sink() {}
+    virtual void write(const void* data, size_t size) = 0;
+    virtual uint64_t tell() = 0;
+    // overwrite already written data, used for the offset table
+    virtual void write_at(uint64_t position, const void* data, size_t size) = 0;
+};
+
+class FileSink : public Sink {
+public:
+    explicit FileSink(const std::string& filename) : filename_(filename), position_(0) {
+        file_ = fopen(filename.c_str(), "wb");
+        if (!file_) {
+            throw std::runtime_error("cannot open file " + filename + " for writing");
+        }
+    }
+
+    ~FileSink() {
+        if (file_) {
+            fclose(file_);
+        }
+    }
+
+    void write(const void* data, size_t size) {
+        if (fwrite(data, 1, size, file_) != size) {
+            throw std::runtime_error("failed writing to " + filename_ + ", disk full?");
+        }
+        position_ += size;
+    }
+
+    uint64_t tell() {
+        return position_;
+    }
+
+    void write_at(uint64_t position, const void* data, size_t size) {
+        seek(position);
+        if (fwrite(data, 1, size, file_) != size) {
+            throw std::runtime_error("failed writing to " + filename_);
+        }
+        seek(position_);
+    }
+
+    // flush and close the file, errors of the final write are reported
+    void close() {
+        FILE* file = file_;
+        file_ = NULL;
+        if (fclose(file) != 0) {
+            throw std::runtime_error("failed writing to " + filename_);
+        }
+    }
+
+private:
+    FileSink(const FileSink&);
+    FileSink& operator=(const FileSink&);
+
+    void seek(uint64_t position) {
+#ifdef _WIN32
+        int ret = _fseeki64(file_, (__int64) position, SEEK_SET);
+#else
+        int ret = fseeko(file_, (off_t) position, SEEK_SET);
+#endif
+        if (ret != 0) {
+            throw std::runtime_error("failed seeking in " + filename_);
+        }
+    }
+
+    std::string filename_;
+    FILE* file_;
+    uint64_t position_;
+};
+
+// encodes into a byte buffer, e.g. for sending or hashing images without
+// touching the file system
+class MemorySink : public Sink {
+public:
+    explicit MemorySink(std::vector<unsigned char>& buffer) : buffer_(buffer) {
+        buffer_.clear();
+    }
+
+    void write(const void* data, size_t size) {
+        const unsigned char* ptr = (const unsigned char*) data;
+        buffer_.insert(buffer_.end(), ptr, ptr + size);
+    }
+
+    uint64_t tell() {
+        return buffer_.size();
+    }
+
+    void write_at(uint64_t position, const void* data, size_t size) {
+        if (position + size > buffer_.size()) {
+            throw std::runtime_error("write beyond the end of the memory buffer");
+        }
+        memcpy(&buffer_[position], data, size);
+    }
+
+private:
+    MemorySink(const MemorySink&);
+    MemorySink& operator=(const MemorySink&);
+
+    std::vector<unsigned char>& buffer_;
+};
+
+template <typename V>
+inline void put(std::vector<unsigned char>& out, V value) {
+    const unsigned char* ptr = (const unsigned char*) &value;
+    out.insert(out.end(), ptr, ptr + sizeof(V));
+}
+
+// null-terminated string
+inline void put_string(std::vector<unsigned char>& out, const std::string& str) {
+    out.insert(out.end(), str.begin(), str.end());
+    out.push_back(0);
+}
+
+inline void put_attribute(std::vector<unsigned char>& out, const std::string& name,
+        const std::string& type, const std::vector<unsigned char>& value) {
+    put_string(out, name);
+    put_string(out, type);
+    put(out, (int32_t) value.size());
+    out.insert(out.end(), value.begin(), value.end());
+}
+
+// attributes of the header of an image or of a part of a multipart file,
+// terminated by a null byte; num_chunks is only stored for parts
+inline void write_header(std::vector<unsigned char>& out, const WriteLayout& layout,
+        size_t num_chunks) {
+    std::vector<unsigned char> value;
+    for (size_t ci = 0; ci < layout.channel_names.size(); ci++) {
+        put_string(value, layout.channel_names[ci]);
+        put(value, (int32_t) layout.pixel_types[ci]);
+        // pLinear and reserved bytes
+        put(value, (uint32_t) 0);
+        // x and y sampling
+        put(value, (int32_t) 1);
+        put(value, (int32_t) 1);
+    }
+    value.push_back(0);
+    put_attribute(out, "channels", "chlist", value);
+
+    value.assign(1, (unsigned char) layout.compression);
+    put_attribute(out, "compression", "compression", value);
+
+    value.clear();
+    put(value, (int32_t) 0);
+    put(value, (int32_t) 0);
+    put(value, (int32_t) layout.width - 1);
+    put(value, (int32_t) layout.height - 1);
+    put_attribute(out, "dataWindow", "box2i", value);
+    put_attribute(out, "displayWindow", "box2i", value);
+
+    // increasing y
+    value.assign(1, 0);
+    put_attribute(out, "lineOrder", "lineOrder", value);
+
+    value.clear();
+    put(value, 1.f);
+    put_attribute(out, "pixelAspectRatio", "float", value);
+    put_attribute(out, "screenWindowWidth", "float", value);
+
+    value.clear();
+    put(value, 0.f);
+    put(value, 0.f);
+    put_attribute(out, "screenWindowCenter", "v2f", value);
+
+    if (layout.tiled) {
+        value.clear();
+        put(value, (uint32_t) layout.tile_size_x);
+        put(value, (uint32_t) layout.tile_size_y);
+        value.push_back((unsigned char) (layout.level_mode | (layout.rounding_mode << 4)));
+        put_attribute(out, "tiles", "tiledesc", value);
+    }
+
+    if (layout.part >= 0) {
+        value.assign(layout.part_name.begin(), layout.part_name.end());
+        put_attribute(out, "name", "string", value);
+
+        const std::string type = layout.tiled ? "tiledimage" : "scanlineimage";
+        value.assign(type.begin(), type.end());
+        put_attribute(out, "type", "string", value);
+
+        value.clear();
+        put(value, (int32_t) num_chunks);
+        put_attribute(out, "chunkCount", "int", value);
+    }
+
+    // end of header
+    out.push_back(0);
+}
+
+// convert n samples from src_type to dst_type
+inline void store_row(const unsigned char* src, int src_type, unsigned char* dst,
+        int dst_type, size_t n) {
+    if (src_type == dst_type) {
+        memcpy(dst, src, n * pixel_type_size(src_type));
+        return;
+    }
+#ifdef EXR_CHUNKS_F16C
+    static const bool has_f16c = cpu_has_f16c();
+    if (has_f16c && src_type == TINYEXR_PIXELTYPE_FLOAT && dst_type == TINYEXR_PIXELTYPE_HALF) {
+        float_to_half_f16c(src, dst, n);
+        return;
+    }
+#endif
+    const size_t src_size = pixel_type_size(src_type);
+    for (size_t ii = 0; ii < n; ii++, src += src_size) {
+        if (dst_type == TINYEXR_PIXELTYPE_HALF) {
+            uint16_t h = convert_sample<uint16_t>(src, src_type);
+            memcpy(dst + 2 * ii, &h, 2);
+        } else if (dst_type == TINYEXR_PIXELTYPE_FLOAT) {
+            float f = convert_sample<float>(src, src_type);
+            memcpy(dst + 4 * ii, &f, 4);
+        } else {
+            uint32_t u = convert_sample<uint32_t>(src, src_type);
+            memcpy(dst + 4 * ii, &u, 4);
+        }
+    }
+}
+
+// row-major image with one plane per channel, converted to the pixel
+// types of the file while encoding
+class PlanarSource {
+public:
+    PlanarSource(const std::vector<const unsigned char*>& planes,
+            const std::vector<int>& pixel_types, int width) :
+            planes_(planes), pixel_types_(pixel_types), width_(width) {}
+
+    // write the block of pixels [x_first, x_first + width) x [y_first,
+    // y_first + num_lines) in the layout of an OpenEXR chunk to raw
+    void fill(const WriteLayout& layout, int x_first, int y_first, int width, int num_lines,
+            unsigned char* raw) const {
+        for (int yi = 0; yi < num_lines; yi++) {
+            for (size_t ci = 0; ci < planes_.size(); ci++) {
+                const size_t sample_size = pixel_type_size(pixel_types_[ci]);
+                store_row(planes_[ci] + ((size_t) (y_first + yi) * width_ + x_first) * sample_size,
+                        pixel_types_[ci], raw, layout.pixel_types[ci], width);
+                raw += width * pixel_type_size(layout.pixel_types[ci]);
+            }
+        }
+    }
+
+private:
+    std::vector<const unsigned char*> planes_;
+    std::vector<int> pixel_types_;
+    int width_;
+};
+
+// pixel type of Matlab arrays of the sample type T, and the type their
+// samples are converted to before encoding; double arrays are written as
+// floats, uint16 arrays hold half precision floats
+template <typename T>
+struct SampleTraits;
+
+template <>
+struct SampleTraits<float> {
+    typedef float Staged;
+    static const int pixel_type = TINYEXR_PIXELTYPE_FLOAT;
+};
+
+template <>
+struct SampleTraits<double> {
+    typedef float Staged;
+    static const int pixel_type = TINYEXR_PIXELTYPE_FLOAT;
+};
+
+template <>
+struct SampleTraits<uint16_t> {
+    typedef uint16_t Staged;
+    static const int pixel_type = TINYEXR_PIXELTYPE_HALF;
+};
+
+template <>
+struct SampleTraits<uint32_t> {
+    typedef uint32_t Staged;
+    static const int pixel_type = TINYEXR_PIXELTYPE_UINT;
+};
+
+// number of rows and columns transposed at once by ColumnMajorSource
+const int transpose_block = 32;
+
+// Matlab array of height x width x num_channels samples in column-major
+// order, channel ci of the file is stored in the array channel
+// channel_order[ci]. Blocks of transpose_block x transpose_block samples
+// are transposed into a buffer on the stack and converted from there into
+// the chunk, so the image is never copied as a whole.
+template <typename T>
+class ColumnMajorSource {
+public:
+    typedef typename SampleTraits<T>::Staged Staged;
+
+    ColumnMajorSource(const T* data, int width, int height, const std::vector<int>& channel_order) :
+            data_(data), width_(width), height_(height), channel_order_(channel_order) {}
+
+    void fill(const WriteLayout& layout, int x_first, int y_first, int width, int num_lines,
+            unsigned char* raw) const {
+        const size_t line_size = width * layout.pixel_size();
+        // offset of the current channel within a scan line of the chunk
+        size_t channel_offset = 0;
+
+        Staged block[transpose_block * transpose_block];
+        for (size_t ci = 0; ci < channel_order_.size(); ci++) {
+            const int dst_type = layout.pixel_types[ci];
+            const size_t dst_size = pixel_type_size(dst_type);
+            const T* plane = data_ + (size_t) channel_order_[ci] * width_ * height_;
+            for (int y0 = 0; y0 < num_lines; y0 += transpose_block) {
+                const int block_height = std::min(transpose_block, num_lines - y0);
+                for (int x0 = 0; x0 < width; x0 += transpose_block) {
+                    const int block_width = std::min(transpose_block, width - x0);
+                    // contiguous segments of columns become rows of the block
+                    for (int xi = 0; xi < block_width; xi++) {
+                        const T* column = plane + (size_t) (x_first + x0 + xi) * height_ +
+                                y_first + y0;
+                        for (int yi = 0; yi < block_height; yi++) {
+                            block[yi * transpose_block + xi] = (Staged) column[yi];
+                        }
+                    }
+                    for (int yi = 0; yi < block_height; yi++) {
+                        store_row((const unsigned char*) &block[yi * transpose_block],
+                                SampleTraits<T>::pixel_type,
+                                raw + (y0 + yi) * line_size + channel_offset + x0 * dst_size,
+                                dst_type, block_width);
+                    }
+                }
+            }
+            channel_offset += width * dst_size;
+        }
+    }
+
+private:
+    const T* data_;
+    int width_;
+    int height_;
+    std::vector<int> channel_order_;
+};
+
+// Compress a block of pixels with num_lines scan lines of the given width,
+// stored in raw, and append it to out. Blocks that do not get smaller are
+// stored uncompressed, as required by the file format.
+inline void compress_block(const unsigned char* raw, const WriteLayout& layout, int width,
+        int num_lines, std::vector<unsigned char>& out) {
+    const size_t raw_size = (size_t) num_lines * width * layout.pixel_size();
+    const size_t header_size = out.size();
+    // upper bound of the compressed size for all compression types
+    out.resize(header_size + 8192 + 2 * raw_size);
+    unsigned char* dst = &out[header_size];
+
+    size_t data_size = raw_size;
+    if (layout.compression == TINYEXR_COMPRESSIONTYPE_RLE) {
+        tinyexr::tinyexr_uint64 compressed_size = 0;
+        tinyexr::CompressRle(dst, compressed_size, raw, (unsigned long) raw_size);
+        data_size = (size_t) compressed_size;
+    } else if (layout.compression == TINYEXR_COMPRESSIONTYPE_ZIPS ||
+            layout.compression == TINYEXR_COMPRESSIONTYPE_ZIP) {
+        tinyexr::tinyexr_uint64 compressed_size = 0;
+        tinyexr::CompressZip(dst, compressed_size, raw, (unsigned long) raw_size);
+        data_size = (size_t) compressed_size;
+#if TINYEXR_USE_PIZ
+    } else if (layout.compression == TINYEXR_COMPRESSIONTYPE_PIZ) {
+        std::vector<tinyexr::ChannelInfo> channels(layout.channel_names.size());
+        for (size_t ci = 0; ci < channels.size(); ci++) {
+            channels[ci].name = layout.channel_names[ci];
+            channels[ci].pixel_type = layout.pixel_types[ci];
+            channels[ci].x_sampling = 1;
+            channels[ci].y_sampling = 1;
+            channels[ci].p_linear = 0;
+        }
+        unsigned int compressed_size = 0;
+        tinyexr::CompressPiz(dst, &compressed_size, raw, raw_size, channels, width, num_lines);
+        data_size = compressed_size;
+#endif
+    } else if (layout.compression != TINYEXR_COMPRESSIONTYPE_NONE) {
+        throw std::runtime_error("unsupported compression type " + std::to_string(layout.compression));
+    }
+
+    if (data_size == 0 || data_size >= raw_size) {
+        memcpy(dst, raw, raw_size);
+        data_size = raw_size;
+    }
+    out.resize(header_size + data_size);
+}
+
+// pixel type in which the samples of a downsampled level are kept, half
+// samples are averaged in float precision
+inline int level_pixel_type(int pixel_type) {
+    return pixel_type == TINYEXR_PIXELTYPE_UINT ? TINYEXR_PIXELTYPE_UINT : TINYEXR_PIXELTYPE_FLOAT;
+}
+
+// one resolution level of a tiled image held in memory, row-major with one
+// plane per channel
+struct LevelImage {
+    int width;
+    int height;
+    std::vector<int> pixel_types;
+    std::vector<std::vector<unsigned char> > planes;
+
+    PlanarSource source() const {
+        std::vector<const unsigned char*> plane_ptrs(planes.size());
+        for (size_t ci = 0; ci < planes.size(); ci++) {
+            plane_ptrs[ci] = &planes[ci][0];
+        }
+        return PlanarSource(plane_ptrs, pixel_types, width);
+    }
+};
+
+// Box filter the width x height image provided by source to dst_width x
+// dst_height pixels, each output pixel is the average of the input pixels
+// it covers. The output rows are computed in parallel.
+template <typename Source>
+inline void downsample(const Source& source, const WriteLayout& layout, int width, int height,
+        int dst_width, int dst_height, int num_threads, LevelImage& dst) {
+    // read the source in the precision used for filtering
+    WriteLayout level_layout = layout;
+    for (size_t ci = 0; ci < layout.pixel_types.size(); ci++) {
+        level_layout.pixel_types[ci] = level_pixel_type(layout.pixel_types[ci]);
+    }
+    const size_t num_channels = level_layout.pixel_types.size();
+    const size_t line_size = width * level_layout.pixel_size();
+    std::vector<size_t> channel_offsets(num_channels, 0);
+    for (size_t ci = 1; ci < num_channels; ci++) {
+        channel_offsets[ci] = channel_offsets[ci - 1] +
+                width * pixel_type_size(level_layout.pixel_types[ci - 1]);
+    }
+
+    dst.width = dst_width;
+    dst.height = dst_height;
+    dst.pixel_types = level_layout.pixel_types;
+    dst.planes.resize(num_channels);
+    for (size_t ci = 0; ci < num_channels; ci++) {
+        dst.planes[ci].resize((size_t) dst_width * dst_height * 4);
+    }
+
+    // horizontal footprint of each output pixel
+    std::vector<int> x_first(dst_width + 1);
+    for (int x = 0; x <= dst_width; x++) {
+        x_first[x] = (int) ((int64_t) x * width / dst_width);
+    }
+
+    #pragma omp parallel num_threads(num_threads)
+    {
+        std::vector<unsigned char> rows;
+        #pragma omp for schedule(dynamic)
+        for (int y = 0; y < dst_height; y++) {
+            const int y_begin = (int) ((int64_t) y * height / dst_height);
+            const int y_end = std::max(y_begin + 1, (int) ((int64_t) (y + 1) * height / dst_height));
+            rows.resize((y_end - y_begin) * line_size);
+            source.fill(level_layout, 0, y_begin, width, y_end - y_begin, &rows[0]);
+
+            for (size_t ci = 0; ci < num_channels; ci++) {
+                const int type = level_layout.pixel_types[ci];
+                const size_t sample_size = pixel_type_size(type);
+                unsigned char* dst_row = &dst.planes[ci][(size_t) y * dst_width * 4];
+                for (int x = 0; x < dst_width; x++) {
+                    const int x_begin = x_first[x];
+                    const int x_end = std::max(x_begin + 1, x_first[x + 1]);
+                    double sum = 0;
+                    for (int yi = 0; yi < y_end - y_begin; yi++) {
+                        const unsigned char* src = &rows[yi * line_size + channel_offsets[ci]];
+                        for (int xi = x_begin; xi < x_end; xi++) {
+                            sum += convert_sample<double>(src + xi * sample_size, type);
+                        }
+                    }
+                    const double mean = sum / ((double) (x_end - x_begin) * (y_end - y_begin));
+                    if (type == TINYEXR_PIXELTYPE_UINT) {
+                        uint32_t u = (uint32_t) (mean + 0.5);
+                        memcpy(dst_row + 4 * x, &u, 4);
+                    } else {
+                        float f = (float) mean;
+                        memcpy(dst_row + 4 * x, &f, 4);
+                    }
+                }
+            }
+        }
+    }
+}
+
+// number of threads used for encoding, 0 selects the OpenMP default
+inline int encoder_threads(int num_threads) {
+#ifdef _OPENMP
+    return num_threads > 0 ? num_threads : omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+// Compress the chunks [0, num_chunks) with encoder in parallel, in batches
+// of a few chunks per thread, each batch is then appended to sink in order
+// before the next one is compressed, so memory use does not depend on the
+// image size. The file positions of the chunks are stored in offsets.
+template <typename Encoder>
+inline void write_chunks(const Encoder& encoder, int num_chunks, int num_threads, Sink& sink,
+        uint64_t* offsets) {
+    const int batch_size = 4 * num_threads;
+    std::vector<std::vector<unsigned char> > chunks(batch_size);
+    for (int batch_begin = 0; batch_begin < num_chunks; batch_begin += batch_size) {
+        const int batch_end = std::min(num_chunks, batch_begin + batch_size);
+        std::string error;
+        #pragma omp parallel num_threads(num_threads)
+        {
+            std::vector<unsigned char> raw;
+            #pragma omp for schedule(dynamic)
+            for (int chunk = batch_begin; chunk < batch_end; chunk++) {
+                try {
+                    std::vector<unsigned char>& out = chunks[chunk - batch_begin];
+                    out.clear();
+                    encoder(chunk, raw, out);
+                } catch (std::exception& e) {
+                    #pragma omp critical
+                    error = e.what();
+                }
+            }
+        }
+        if (!error.empty()) {
+            throw std::runtime_error(error);
+        }
+
+        for (int chunk = batch_begin; chunk < batch_end; chunk++) {
+            offsets[chunk] = sink.tell();
+            const std::vector<unsigned char>& out = chunks[chunk - batch_begin];
+            sink.write(&out[0], out.size());
+        }
+    }
+}
+
+// encodes blocks of scan lines: part number (only in multipart files), y
+// coordinate, data size and data
+template <typename Source>
+struct ScanlineEncoder {
+    ScanlineEncoder(const Source& source, const WriteLayout& layout, int lines_per_chunk) :
+            source(source), layout(layout), lines_per_chunk(lines_per_chunk) {}
+
+    void operator()(int chunk, std::vector<unsigned char>& raw,
+            std::vector<unsigned char>& out) const {
+        const int y = chunk * lines_per_chunk;
+        const int num_lines = std::min(lines_per_chunk, layout.height - y);
+        raw.resize(num_lines * layout.width * layout.pixel_size());
+        source.fill(layout, 0, y, layout.width, num_lines, &raw[0]);
+
+        if (layout.part >= 0) {
+            put(out, (int32_t) layout.part);
+        }
+        put(out, (int32_t) y);
+        const size_t size_position = out.size();
+        put(out, (int32_t) 0);
+        compress_block(&raw[0], layout, layout.width, num_lines, out);
+        int32_t data_size = (int32_t) (out.size() - size_position - 4);
+        memcpy(&out[size_position], &data_size, 4);
+    }
+
+    const Source& source;
+    const WriteLayout& layout;
+    int lines_per_chunk;
+};
+
+// encodes the tiles of one level in row-major order: part number (only in
+// multipart files), tile coordinates, level, data size and data
+template <typename Source>
+struct TileEncoder {
+    TileEncoder(const Source& source, const WriteLayout& layout, int level_x, int level_y,
+            int level_width, int level_height) :
+            source(source), layout(layout), level_x(level_x), level_y(level_y),
+            level_width(level_width), level_height(level_height),
+            num_tiles_x((level_width + layout.tile_size_x - 1) / layout.tile_size_x) {}
+
+    void operator()(int chunk, std::vector<unsigned char>& raw,
+            std::vector<unsigned char>& out) const {
+        const int tile_x = chunk % num_tiles_x;
+        const int tile_y = chunk / num_tiles_x;
+        const int x_first = tile_x * layout.tile_size_x;
+        const int y_first = tile_y * layout.tile_size_y;
+        const int tile_width = std::min(layout.tile_size_x, level_width - x_first);
+        const int tile_height = std::min(layout.tile_size_y, level_height - y_first);
+        raw.resize((size_t) tile_width * tile_height * layout.pixel_size());
+        source.fill(layout, x_first, y_first, tile_width, tile_height, &raw[0]);
+
+        if (layout.part >= 0) {
+            put(out, (int32_t) layout.part);
+        }
+        put(out, (int32_t) tile_x);
+        put(out, (int32_t) tile_y);
+        put(out, (int32_t) level_x);
+        put(out, (int32_t) level_y);
+        const size_t size_position = out.size();
+        put(out, (int32_t) 0);
+        compress_block(&raw[0], layout, tile_width, tile_height, out);
+        int32_t data_size = (int32_t) (out.size() - size_position - 4);
+        memcpy(&out[size_position], &data_size, 4);
+    }
+
+    const Source& source;
+    const WriteLayout& layout;
+    int level_x;
+    int level_y;
+    int level_width;
+    int level_height;
+    int num_tiles_x;
+};
+
+// Encode the scan line image provided by source and append its chunks to
+// sink, their positions are stored in offsets.
+template <typename Source>
+inline void write_scanline_chunks(const Source& source, const WriteLayout& layout,
+        int num_threads, Sink& sink, uint64_t* offsets) {
+    const int lines_per_chunk = exr_chunks::lines_per_chunk(layout.compression);
+    const int num_chunks = (layout.height + lines_per_chunk - 1) / lines_per_chunk;
+    write_chunks(ScanlineEncoder<Source>(source, layout, lines_per_chunk), num_chunks,
+            num_threads, sink, offsets);
+}
+
+// number of resolution levels of a tiled image to be written along x and y
+inline void num_levels(const WriteLayout& layout, int& num_levels_x, int& num_levels_y) {
+    num_levels_x = 1;
+    num_levels_y = 1;
+    if (layout.level_mode == LEVEL_MODE_MIPMAP) {
+        num_levels_x = round_log2(std::max(layout.width, layout.height), layout.rounding_mode) + 1;
+        num_levels_y = num_levels_x;
+    } else if (layout.level_mode == LEVEL_MODE_RIPMAP) {
+        num_levels_x = round_log2(layout.width, layout.rounding_mode) + 1;
+        num_levels_y = round_log2(layout.height, layout.rounding_mode) + 1;
+    }
+}
+
+inline int num_tiles(const WriteLayout& layout, int level_x, int level_y) {
+    const int level_width = level_size(layout.width, level_x, layout.rounding_mode);
+    const int level_height = level_size(layout.height, level_y, layout.rounding_mode);
+    return ((level_width + layout.tile_size_x - 1) / layout.tile_size_x) *
+            ((level_height + layout.tile_size_y - 1) / layout.tile_size_y);
+}
+
+// Writes a chain of num_levels levels of a tiled image, starting with the
+// level (level_x, level_y) provided by source. Each following level is
+// computed from the previous one by downsampling, with the level indices
+// increasing by step_x and step_y. The tiles are appended to sink and their
+// positions are stored in offsets, which is advanced accordingly.
+class LevelChainWriter {
+public:
+    LevelChainWriter(const WriteLayout& layout, int num_threads, Sink& sink, uint64_t*& offsets) :
+            layout_(layout), num_threads_(num_threads), sink_(sink), offsets_(offsets) {}
+
+    template <typename Source>
+    void write(const Source& source, int level_x, int level_y, int step_x, int step_y,
+            int num_levels) {
+        write_level(source, level_x, level_y);
+        if (num_levels < 2) {
+            return;
+        }
+        LevelImage previous, next;
+        downsample(source, layout_, level_width(level_x), level_height(level_y),
+                level_width(level_x + step_x), level_height(level_y + step_y), num_threads_,
+                previous);
+        for (int li = 1; li < num_levels; li++) {
+            level_x += step_x;
+            level_y += step_y;
+            write_level(previous.source(), level_x, level_y);
+            if (li + 1 < num_levels) {
+                downsample(previous.source(), layout_, previous.width, previous.height,
+                        level_width(level_x + step_x), level_height(level_y + step_y),
+                        num_threads_, next);
+                std::swap(previous, next);
+            }
+        }
+    }
+
+    int level_width(int level_x) const {
+        return level_size(layout_.width, level_x, layout_.rounding_mode);
+    }
+
+    int level_height(int level_y) const {
+        return level_size(layout_.height, level_y, layout_.rounding_mode);
+    }
+
+private:
+    template <typename Source>
+    void write_level(const Source& source, int level_x, int level_y) {
+        const int num_chunks = num_tiles(layout_, level_x, level_y);
+        write_chunks(TileEncoder<Source>(source, layout_, level_x, level_y,
+                level_width(level_x), level_height(level_y)), num_chunks, num_threads_, sink_,
+                offsets_);
+        offsets_ += num_chunks;
+    }
+
+    const WriteLayout& layout_;
+    int num_threads_;
+    Sink& sink_;
+    uint64_t*& offsets_;
+};
+
+// Encode the tiled image provided by source and append its tiles to sink,
+// their positions are stored in offsets. For mip and rip maps, the lower
+// resolution levels are computed while writing, only the previous level of
+// each chain of levels is kept in memory.
+template <typename Source>
+inline void write_tile_chunks(const Source& source, const WriteLayout& layout, int num_threads,
+        Sink& sink, uint64_t* offsets) {
+    int num_levels_x, num_levels_y;
+    num_levels(layout, num_levels_x, num_levels_y);
+    LevelChainWriter writer(layout, num_threads, sink, offsets);
+    if (layout.level_mode != LEVEL_MODE_RIPMAP) {
+        // levels along the diagonal
+        writer.write(source, 0, 0, 1, 1, num_levels_x);
+    } else {
+        // rows of levels with increasing level_y, the first level of each
+        // row is computed from the first level of the previous one
+        writer.write(source, 0, 0, 1, 0, num_levels_x);
+        LevelImage column, next;
+        for (int ly = 1; ly < num_levels_y; ly++) {
+            if (ly == 1) {
+                downsample(source, layout, layout.width, layout.height, layout.width,
+                        writer.level_height(ly), num_threads, column);
+            } else {
+                downsample(column.source(), layout, column.width, column.height, layout.width,
+                        writer.level_height(ly), num_threads, next);
+                std::swap(column, next);
+            }
+            writer.write(column.source(), 0, ly, 1, 0, num_levels_x);
+        }
+    }
+}
+
+// number of chunks of an image, i.e. of blocks of scan lines or of the
+// tiles of all levels
+inline size_t num_chunks(const WriteLayout& layout) {
+    if (layout.tiled) {
+        if (layout.tile_size_x < 1 || layout.tile_size_y < 1) {
+            throw std::runtime_error("tile size must be positive");
+        }
+        int num_levels_x, num_levels_y;
+        num_levels(layout, num_levels_x, num_levels_y);
+        size_t num_chunks = 0;
+        for (int ly = 0; ly < num_levels_y; ly++) {
+            for (int lx = 0; lx < num_levels_x; lx++) {
+                if (layout.level_mode == LEVEL_MODE_RIPMAP || lx == ly) {
+                    num_chunks += num_tiles(layout, lx, ly);
+                }
+            }
+        }
+        return num_chunks;
+    }
+    const int lines_per_chunk = exr_chunks::lines_per_chunk(layout.compression);
+    if (lines_per_chunk == 0) {
+        throw std::runtime_error("unsupported compression type " + std::to_string(layout.compression));
+    }
+    return (layout.height + lines_per_chunk - 1) / lines_per_chunk;
+}
+
+// Encode the images provided by sources and write them to sink, as a
+// single part file for one image or as a multipart file with one part per
+// image otherwise. Magic number, version field and all headers are written
+// first, followed by placeholders for the offset tables, which are filled
+// in once all chunks have been written. The chunks of each part are
+// compressed in parallel.
+template <typename Source>
+inline void write_file(const std::vector<Source>& sources, std::vector<WriteLayout> parts,
+        int num_threads, Sink& sink) {
+    const bool multipart = parts.size() > 1;
+    std::vector<size_t> chunk_counts(parts.size());
+    std::vector<unsigned char> header;
+    const unsigned char magic[] = {0x76, 0x2f, 0x31, 0x01};
+    header.insert(header.end(), magic, magic + 4);
+    int32_t version = 2;
+    for (size_t pi = 0; pi < parts.size(); pi++) {
+        parts[pi].part = multipart ? (int) pi : -1;
+        chunk_counts[pi] = num_chunks(parts[pi]);
+        if (parts[pi].tiled && !multipart) {
+            version |= 0x200;
+        }
+        for (size_t ci = 0; ci < parts[pi].channel_names.size(); ci++) {
+            if (parts[pi].channel_names[ci].size() > 31 || parts[pi].part_name.size() > 31) {
+                version |= 0x400;
+            }
+        }
+    }
+    if (multipart) {
+        version |= 0x1000;
+    }
+    put(header, version);
+    for (size_t pi = 0; pi < parts.size(); pi++) {
+        write_header(header, parts[pi], chunk_counts[pi]);
+    }
+    if (multipart) {
+        // end of the list of headers
+        header.push_back(0);
+    }
+    sink.write(&header[0], header.size());
+
+    std::vector<uint64_t> table_positions(parts.size());
+    for (size_t pi = 0; pi < parts.size(); pi++) {
+        table_positions[pi] = sink.tell();
+        std::vector<uint64_t> offsets(chunk_counts[pi], 0);
+        sink.write(&offsets[0], offsets.size() * sizeof(uint64_t));
+    }
+
+    num_threads = encoder_threads(num_threads);
+    for (size_t pi = 0; pi < parts.size(); pi++) {
+        std::vector<uint64_t> offsets(chunk_counts[pi], 0);
+        if (parts[pi].tiled) {
+            write_tile_chunks(sources[pi], parts[pi], num_threads, sink, &offsets[0]);
+        } else {
+            write_scanline_chunks(sources[pi], parts[pi], num_threads, sink, &offsets[0]);
+        }
+        sink.write_at(table_positions[pi], &offsets[0], offsets.size() * sizeof(uint64_t));
+    }
+}
+
+// single part file
+template <typename Source>
+inline void write_file(const Source& source, const WriteLayout& layout, int num_threads,
+        Sink& sink) {
+    write_file(std::vector<Source>(1, source), std::vector<WriteLayout>(1, layout), num_threads,
+            sink);
+}
+
+} // namespace exr_chunks
+
+#endif // EXR_ENCODE_H
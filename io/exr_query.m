@@ -27,7 +27,10 @@
 %
 % Usage:
 % 
-% meta = exr_query(filename), where meta is a struct with the fields:
+% [meta, errors] = exr_query(filename), where filename is the path to an
+% EXR file, a uint8 array holding the contents of an EXR file, or a cell
+% array of paths, and meta is a struct (array of the same size as the cell
+% array) with the fields:
 %
 % - width, height, num_channels: image dimensions
 % - compression_type: number indicating the compression type, see the
@@ -37,7 +40,19 @@
 %   each channel
 % - comments: a string with the contents of a custom header attribute
 %   called comments, if available
-function meta = exr_query(fname, varargin)
+% - tiled: true for tiled images
+% - tile_size: [tile_width, tile_height], zeros for scan line images
+% - num_levels: number of resolution levels [num_levels_x,
+%   num_levels_y] of mip or rip mapped images, [1, 1] otherwise
+%
+% The headers of multiple files are parsed in parallel. The meta data of
+% each file is cached together with its modification time and size, so
+% querying unchanged files again does not read from disk; the cache is
+% emptied by clear exr_query_mex.
+% If the optional output errors is requested, it holds an error message for
+% each file that could not be queried (with empty meta data fields), and an
+% empty string otherwise. Without it, the first error is raised.
+function [meta, errors] = exr_query(fname, varargin)
     % avoid expensive checks in mex_auto when it's not necessary
     [varargin, dontbuild] = arg(varargin, 'dontbuild', false, false);
     arg(varargin);
@@ -50,8 +65,13 @@ function meta = exr_query(fname, varargin)
     mex_auto(...
         'dontbuild', dontbuild, ...
         'sources', {'exr_query_mex.cpp'}, ...
-        'headers', {'tinyexr.h'}, ...
+        'headers', {'tinyexr.h', 'exr_chunks.h'}, ...
+        'openmp', true, ...
         ['-I', header_dir]);
     
-    meta = exr_query_mex(fname);
+    if nargout > 1
+        [meta, errors] = exr_query_mex(fname);
+    else
+        meta = exr_query_mex(fname);
+    end
 end
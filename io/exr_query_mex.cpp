@@ -23,116 +23,305 @@
  *
  **************************************************************************
  *
- * Mex file for querying meta data from an OpenEXR image file.
+ * Mex file for querying meta data from OpenEXR image files. Usage:
+ *
+ * [meta, errors] = exr_query_mex(input), where input is either
+ * - a path to an EXR file, which is memory mapped so that only the header
+ *   is actually read from disk,
+ * - a uint8 array holding the contents of an EXR file, or
+ * - a cell array of paths, whose headers are parsed in parallel.
+ * meta is a struct, or a struct array of the same size as the cell array.
+ * errors is a cell array holding an error message for each file that could
+ * not be queried and an empty string otherwise, the fields of the
+ * corresponding structs are empty. If errors is not requested, the first
+ * error is raised.
+ *
+ * The meta data of files on disk is cached per absolute path, together with
+ * the modification time and size of each file, so that repeated queries of
+ * unchanged files do not access their contents. The cache is emptied when
+ * the MEX file is cleared or when it exceeds max_cache_entries files.
  *
  * TODO: parse all custom attributes
  */
 
+#include <cstdlib>
+#include <map>
+#include <memory>
 #include <string>
 #include <vector>
 
+#ifdef _WIN32
+    #define NOMINMAX
+    #include <windows.h>
+#else
+    #include <sys/stat.h>
+#endif
+
 #include <mex.h>
 
 #define TINYEXR_IMPLEMENTATION
 #include "tinyexr.h"
 
+#include "exr_chunks.h"
+
 #define NUMBER_OF_FIELDS (sizeof(field_names)/sizeof(*field_names))
 
+static const char *field_names[] = {"width", "height", "num_channels",
+    "compression_type", "channel_names", "channel_types", "comments",
+    "tiled", "tile_size", "num_levels"};
+
+// meta data extracted from an EXR header
+struct ExrInfo {
+    int width;
+    int height;
+    int num_channels;
+    int compression_type;
+    std::vector<std::string> channel_names;
+    std::vector<std::string> channel_types;
+    std::string comments;
+    bool tiled;
+    int tile_size[2];
+    int num_levels[2];
+};
+
+ExrInfo query(exr_chunks::ExrFile& file) {
+    const EXRHeader& exr_header = file.header();
+    ExrInfo info;
+    info.width = file.width();
+    info.height = file.height();
+    info.num_channels = exr_header.num_channels;
+    info.compression_type = exr_header.compression_type;
+    for (int i = 0; i < exr_header.num_channels; i++) {
+        info.channel_names.push_back(exr_header.channels[i].name);
+
+        int type = exr_header.pixel_types[i];
+        info.channel_types.push_back((type == TINYEXR_PIXELTYPE_UINT) ? "uint" :
+            ((type == TINYEXR_PIXELTYPE_HALF) ? "half" : "float"));
+    }
+
+    // attempt to parse comments as custom attribute
+    for (int i = 0; i < exr_header.num_custom_attributes; i++) {
+        if (exr_header.custom_attributes[i].size &&
+                0 == strcmp(exr_header.custom_attributes[i].name, "comments")) {
+            info.comments = std::string((char*) exr_header.custom_attributes[i].value);
+        }
+    }
+
+    // tile layout and number of mip / rip map levels along x and y
+    info.tiled = exr_header.tiled != 0;
+    info.tile_size[0] = info.tiled ? exr_header.tile_size_x : 0;
+    info.tile_size[1] = info.tiled ? exr_header.tile_size_y : 0;
+    exr_chunks::num_levels(exr_header, info.num_levels[0], info.num_levels[1]);
+    return info;
+}
+
+// cached meta data of a file, valid as long as modification time and size
+// of the file are unchanged
+struct CacheEntry {
+    long long mtime;
+    long long size;
+    ExrInfo info;
+};
+
+static std::map<std::string, CacheEntry> cache;
+static const size_t max_cache_entries = 65536;
+
+// modification time at the finest resolution of the platform (files are
+// often rewritten within a second with the same size, e.g. when re-rendering
+// a frame) and size of a file
+void file_stamp(const std::string& filename, long long& mtime, long long& size) {
+#ifdef _WIN32
+    WIN32_FILE_ATTRIBUTE_DATA attributes;
+    if (!GetFileAttributesExA(filename.c_str(), GetFileExInfoStandard, &attributes)) {
+        throw std::runtime_error("cannot open file " + filename);
+    }
+    // 100 ns intervals
+    mtime = ((long long) attributes.ftLastWriteTime.dwHighDateTime << 32) | attributes.ftLastWriteTime.dwLowDateTime;
+    size = ((long long) attributes.nFileSizeHigh << 32) | attributes.nFileSizeLow;
+#else
+    struct stat st;
+    if (stat(filename.c_str(), &st) != 0) {
+        throw std::runtime_error("cannot open file " + filename);
+    }
+    #ifdef __APPLE__
+        mtime = (long long) st.st_mtimespec.tv_sec * 1000000000LL + st.st_mtimespec.tv_nsec;
+    #else
+        mtime = (long long) st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    #endif
+    size = (long long) st.st_size;
+#endif
+}
+
+// absolute path of a file, so that relative paths stay valid cache keys when
+// the working directory changes and different spellings of the same path
+// share an entry
+std::string absolute_path(const std::string& filename) {
+#ifdef _WIN32
+    char* path = _fullpath(NULL, filename.c_str(), 0);
+#else
+    char* path = realpath(filename.c_str(), NULL);
+#endif
+    if (!path) {
+        throw std::runtime_error("cannot open file " + filename);
+    }
+    std::string result(path);
+    free(path);
+    return result;
+}
+
+// query a file on disk, the header is only parsed if the file is not in the
+// cache or has changed since it was cached
+ExrInfo query_cached(const std::string& filename) {
+    const std::string key = absolute_path(filename);
+    CacheEntry entry;
+    file_stamp(filename, entry.mtime, entry.size);
+    bool cached = false;
+    #pragma omp critical(exr_query_cache)
+    {
+        std::map<std::string, CacheEntry>::const_iterator it = cache.find(key);
+        if (it != cache.end() && it->second.mtime == entry.mtime && it->second.size == entry.size) {
+            entry.info = it->second.info;
+            cached = true;
+        }
+    }
+    if (cached) {
+        return entry.info;
+    }
+
+    exr_chunks::ExrFile file(filename);
+    entry.info = query(file);
+    #pragma omp critical(exr_query_cache)
+    {
+        // bound the memory held for the whole session
+        if (cache.size() >= max_cache_entries) {
+            cache.clear();
+        }
+        cache[key] = entry;
+    }
+    return entry.info;
+}
+
+mxArray* create_double(double value) {
+    mxArray* field_value = mxCreateDoubleMatrix(1, 1, mxREAL);
+    *mxGetPr(field_value) = value;
+    return field_value;
+}
+
+mxArray* create_pair(const int* values) {
+    mxArray* field_value = mxCreateDoubleMatrix(1, 2, mxREAL);
+    mxGetPr(field_value)[0] = values[0];
+    mxGetPr(field_value)[1] = values[1];
+    return field_value;
+}
+
+// set struct fields of element ii of the struct array meta
+void set_fields(mxArray* meta, size_t ii, const ExrInfo& info) {
+    mxSetFieldByNumber(meta, ii, mxGetFieldNumber(meta, "width"), create_double(info.width));
+    mxSetFieldByNumber(meta, ii, mxGetFieldNumber(meta, "height"), create_double(info.height));
+    mxSetFieldByNumber(meta, ii, mxGetFieldNumber(meta, "num_channels"), create_double(info.num_channels));
+    mxSetFieldByNumber(meta, ii, mxGetFieldNumber(meta, "compression_type"), create_double(info.compression_type));
+
+    // create cell arrays of strings for the channel names and types
+    mxArray* cell_array_ptr_channel_names = mxCreateCellMatrix((mwSize)info.num_channels, 1);
+    mxArray* cell_array_ptr_channel_types = mxCreateCellMatrix((mwSize)info.num_channels, 1);
+    for (int i = 0; i < info.num_channels; i++) {
+        mxSetCell(cell_array_ptr_channel_names, i, mxCreateString(info.channel_names[i].c_str()));
+        mxSetCell(cell_array_ptr_channel_types, i, mxCreateString(info.channel_types[i].c_str()));
+    }
+    mxSetFieldByNumber(meta, ii, mxGetFieldNumber(meta, "channel_names"), cell_array_ptr_channel_names);
+    mxSetFieldByNumber(meta, ii, mxGetFieldNumber(meta, "channel_types"), cell_array_ptr_channel_types);
+
+    mxSetFieldByNumber(meta, ii, mxGetFieldNumber(meta, "comments"),
+        mxCreateString(info.comments.c_str()));
+
+    mxSetFieldByNumber(meta, ii, mxGetFieldNumber(meta, "tiled"), mxCreateLogicalScalar(info.tiled));
+    mxSetFieldByNumber(meta, ii, mxGetFieldNumber(meta, "tile_size"), create_pair(info.tile_size));
+    mxSetFieldByNumber(meta, ii, mxGetFieldNumber(meta, "num_levels"), create_pair(info.num_levels));
+}
+
 void mexFunction( int nlhs, mxArray *plhs[],
         int nrhs, const mxArray *prhs[])
 {
     // check inputs
     if(nrhs != 1) {
-        mexErrMsgTxt("Usage: meta = exr_query(path_to_exr_file)");
+        mexErrMsgTxt("Usage: [meta, errors] = exr_query(path_to_exr_file)");
     }
     
     // read inputs
-    char *filename = mxArrayToString(prhs[0]);
-    
-    try {
-        EXRVersion exr_version;
-        EXRHeader exr_header;
-        InitEXRHeader(&exr_header);
-
-        int ret = ParseEXRVersionFromFile(&exr_version, filename);
-        if (ret != TINYEXR_SUCCESS) {
-            mexErrMsgTxt((std::string("Error parsing EXR version from file ") + 
-                    std::string(filename) + std::string(". Not an OpenEXR file?")).c_str());
+    bool from_memory = mxGetClassID(prhs[0]) == mxUINT8_CLASS;
+    std::vector<std::string> filenames;
+    if (mxIsCell(prhs[0])) {
+        filenames.resize(mxGetNumberOfElements(prhs[0]));
+        for (size_t fi = 0; fi < filenames.size(); fi++) {
+            char* filename = mxArrayToString(mxGetCell(prhs[0], fi));
+            if (!filename) {
+                mexErrMsgTxt("input must be a file name, a cell array of file names or a uint8 array with the file contents.");
+            }
+            filenames[fi] = filename;
+            mxFree(filename);
         }
-
-        if (exr_version.multipart || exr_version.non_image) {
-            mexErrMsgTxt("Loading multipart or DeepImage is not supported yet.\n");
+    } else if (!from_memory) {
+        char *filename = mxArrayToString(prhs[0]);
+        if (!filename) {
+            mexErrMsgTxt("input must be a file name, a cell array of file names or a uint8 array with the file contents.");
         }
-
-        const char** err;
-        ret = ParseEXRHeaderFromFile(&exr_header, &exr_version, filename, err);
-        if (ret != TINYEXR_SUCCESS) {
-            mexErrMsgTxt("parsing header from file failed.\n");
+        filenames.push_back(filename);
+        mxFree(filename);
+    }
+    
+    // query all files, headers that are not cached are parsed in parallel
+    size_t num_files = from_memory ? 1 : filenames.size();
+    std::vector<ExrInfo> infos(num_files);
+    std::vector<std::string> errors(num_files);
+    if (from_memory) {
+        try {
+            exr_chunks::ExrFile file((const unsigned char*) mxGetData(prhs[0]),
+                    mxGetNumberOfElements(prhs[0]));
+            infos[0] = query(file);
+        } catch (std::exception& err) {
+            errors[0] = err.what();
         }
-
-        int height= exr_header.data_window[3] - exr_header.data_window[1] + 1;
-        int width = exr_header.data_window[2] - exr_header.data_window[0] + 1;
-        int num_channels = exr_header.num_channels;
-        int compression_type = exr_header.compression_type;
-
-        std::vector<std::string> vec_chan_names(num_channels);
-        std::vector<std::string> vec_chan_types(num_channels);
-        for (size_t i = 0; i < exr_header.num_channels; i++) {
-            vec_chan_names[i] = std::string(exr_header.channels[i].name);
-
-            int type = exr_header.pixel_types[i];
-            vec_chan_types[i] = (type == TINYEXR_PIXELTYPE_UINT) ? "uint" : 
-                ((type == TINYEXR_PIXELTYPE_HALF) ? "half" : "float");
+    } else {
+        #pragma omp parallel for schedule(dynamic)
+        for (int fi = 0; fi < (int) num_files; fi++) {
+            try {
+                infos[fi] = query_cached(filenames[fi]);
+            } catch (std::exception& err) {
+                errors[fi] = err.what();
+            }
         }
-        
-        // attempt to parse comments as custom attribute
-        std::string comments;
-        for (size_t i = 0; i < exr_header.num_custom_attributes; i++) {
-            if (exr_header.custom_attributes[i].size && 
-                    0 == strcmp(exr_header.custom_attributes[i].name, "comments")) {
-                comments = std::string((char*) exr_header.custom_attributes[i].value);
+    }
+
+    // without the errors output, the first error is raised
+    if (nlhs < 2) {
+        for (size_t fi = 0; fi < num_files; fi++) {
+            if (!errors[fi].empty()) {
+                mexErrMsgTxt((std::string("error reading EXR file ") +
+                        (from_memory ? std::string("from memory") : filenames[fi]) +
+                        std::string(": ") + errors[fi] + std::string("\n")).c_str());
             }
         }
+    }
 
-        // create meta struct
+    // create meta struct (array)
+    if (mxIsCell(prhs[0])) {
+        plhs[0] = mxCreateStructArray(mxGetNumberOfDimensions(prhs[0]),
+                mxGetDimensions(prhs[0]), NUMBER_OF_FIELDS, field_names);
+    } else {
         mwSize dims[2] = {1, 1};
-        const char *field_names[] = {"width", "height", "num_channels", 
-            "compression_type", "channel_names", "channel_types", "comments"};
         plhs[0] = mxCreateStructArray(2, dims, NUMBER_OF_FIELDS, field_names);
-
-        // set struct fields
-        mxArray* field_value = mxCreateDoubleMatrix(1, 1, mxREAL);
-        *mxGetPr(field_value) = width;
-        mxSetFieldByNumber(plhs[0], 0, mxGetFieldNumber(plhs[0], "width"), field_value);
-
-        field_value = mxCreateDoubleMatrix(1, 1, mxREAL);
-        *mxGetPr(field_value) = height;
-        mxSetFieldByNumber(plhs[0], 0, mxGetFieldNumber(plhs[0], "height"), field_value);
-
-        field_value = mxCreateDoubleMatrix(1, 1, mxREAL);
-        *mxGetPr(field_value) = num_channels;
-        mxSetFieldByNumber(plhs[0], 0, mxGetFieldNumber(plhs[0], "num_channels"), field_value);
-        
-        field_value = mxCreateDoubleMatrix(1, 1, mxREAL);
-        *mxGetPr(field_value) = compression_type;
-        mxSetFieldByNumber(plhs[0], 0, mxGetFieldNumber(plhs[0], "compression_type"), field_value);
-
-        // create cell arrays of strings for the channel names and types
-        mxArray* cell_array_ptr_channel_names = mxCreateCellMatrix((mwSize)num_channels, 1);
-        mxArray* cell_array_ptr_channel_types = mxCreateCellMatrix((mwSize)num_channels, 1);
-        for (size_t i = 0; i < num_channels; i++) {
-            mxSetCell(cell_array_ptr_channel_names, i, mxCreateString(vec_chan_names[i].c_str()));
-            mxSetCell(cell_array_ptr_channel_types, i, mxCreateString(vec_chan_types[i].c_str()));
+    }
+    for (size_t fi = 0; fi < num_files; fi++) {
+        if (errors[fi].empty()) {
+            set_fields(plhs[0], fi, infos[fi]);
         }
-        mxSetFieldByNumber(plhs[0], 0, mxGetFieldNumber(plhs[0], "channel_names"), cell_array_ptr_channel_names);
-        mxSetFieldByNumber(plhs[0], 0, mxGetFieldNumber(plhs[0], "channel_types"), cell_array_ptr_channel_types);
-
-        mxSetFieldByNumber(plhs[0], 0, mxGetFieldNumber(plhs[0], "comments"), 
-            mxCreateString(comments.c_str()));
+    }
 
-        FreeEXRHeader(&exr_header);
-    } catch (std::runtime_error err) {
-        mexErrMsgTxt((std::string("error reading EXR file ") + 
-                std::string(filename) + std::string("\n")).c_str());
+    // per file error messages
+    if (nlhs > 1) {
+        plhs[1] = mxCreateCellArray(mxGetNumberOfDimensions(plhs[0]), mxGetDimensions(plhs[0]));
+        for (size_t fi = 0; fi < num_files; fi++) {
+            mxSetCell(plhs[1], fi, mxCreateString(errors[fi].c_str()));
+        }
     }
 }
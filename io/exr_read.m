@@ -27,19 +27,37 @@
 %
 % [image, channel_names] = exr.read_mex(filename, pixel_type), where
 %
+% - filename is the path to an EXR file, or a uint8 array holding the
+%   contents of an EXR file, e.g. fetched from a database or network
 % - the optional argument requested_pixel_type determines if the pixel
 %   values should be converted to single or half precision floats (stored
-%   as uint16), or to uint32; defaults to 'single'
+%   as uint16), to doubles or to uint32; defaults to 'single'
 % - the boolean flag as_img causes the image to be returned as an img
 %   object, if set to true; default is false
 % - imroi is a 6 element array with [x_min, y_min, x_max, y_max, ch_min,
 %   ch_max] specifying a sub-region of the pixels along all three
 %   dimensions
-% - strides is a 3 element array with [stride_x, stride_y, stride_channels]
-%   specifying the step sizes along all three dimensions
+%   for images with none, rle, zips, zip or piz compression, only the
+%   blocks of scan lines or tiles overlapping the region are decompressed
+% - strides is a 2 element array with [stride_x, stride_y] specifying the
+%   step sizes along x and y
+% - decimation determines how strides > 1 are applied: 'point' (default)
+%   only reads the first pixel of each stride_x x stride_y block, 'area'
+%   returns the mean of all pixels of the block, which avoids aliasing;
+%   the blocks are averaged while decoding, without ever storing the full
+%   resolution image
+% - level selects the resolution level of tiled mip or rip mapped images,
+%   0 being the full resolution; a scalar selects the same level along x
+%   and y, rip maps also accept [level_x, level_y]; imroi refers to the
+%   pixels at that level, the number of levels can be obtained from
+%   exr_query()
+% - parts holds the (1-based) indices of the parts of a multipart file to
+%   read, by default all parts are read; the parts must have the same size
+%   and channels
 % Returns:
-% - image is is a 2D or 3D array of floats or unsigned integers (also for
-%   half precision floats), or an img object if as_img is true
+% - image is is a 2D or 3D array of floats, doubles or unsigned integers (also for
+%   half precision floats), or an img object if as_img is true; multipart
+%   files are returned as a 4D array with one image per part
 % - channel_names is a cell array of strings holding the names of each
 %   channel
 function [im, channel_names] = exr_read(fname, varargin)
@@ -48,8 +66,11 @@ function [im, channel_names] = exr_read(fname, varargin)
     [varargin, pixel_type] = arg(varargin, 'pixel_type', 'single', false);
     [varargin, as_img] = arg(varargin, 'as_img', false, false);
     [varargin, imroi] = arg(varargin, 'imroi', [0, 0, 0, 0], false);
-    [varargin, strides] = arg(varargin, 'imroi', [1, 1], false);
+    [varargin, strides] = arg(varargin, 'strides', [1, 1], false);
     [varargin, channel_mask] = arg(varargin, 'channel_mask', [], false);
+    [varargin, level] = arg(varargin, 'level', 0, false);
+    [varargin, decimation] = arg(varargin, 'decimation', 'point', false);
+    [varargin, parts] = arg(varargin, 'parts', [], false);
     arg(varargin);
     
     % get folder containing this script
@@ -60,40 +81,26 @@ function [im, channel_names] = exr_read(fname, varargin)
     mex_auto(...
         'dontbuild', dontbuild, ...
         'sources', {'exr_read_mex.cpp'}, ...
-        'headers', {'tinyexr.h'}, ...
+        'headers', {'tinyexr.h', 'exr_chunks.h'}, ...
+        'openmp', true, ...
         ['-I', header_dir]);
     
     assert(numel(imroi) == 4, 'exr_read:invalid_roi', ...
         'roi must be specified as [x_min, y_min, x_max, y_max].');
     assert(numel(strides) == 2, 'exr_read:invalid_strides', ...
-        'strides must be specified as [stride_x, stride_y, stride_channels].');
-    
-    if any(imroi < 1)
-        meta = exr_query(fname);
-        if imroi(1) < 1
-            imroi(1) = 1;
-        end
-        if imroi(2) < 1
-            imroi(2) = 1;
-        end
-        if imroi(3) < 1
-            imroi(3) = meta.width + imroi(3);
-        end
-        if imroi(4) < 1
-            imroi(4) = meta.height + imroi(4);
-        end
-    end
-    
-    if isempty(channel_mask)
-        if ~exist('meta', 'var')
-            meta = exr_query(fname);
-        end
-        channel_mask = 1 : meta.num_channels;
+        'strides must be specified as [stride_x, stride_y].');
+    assert(any(numel(level) == [1, 2]), 'exr_read:invalid_level', ...
+        'level must be specified as a scalar or as [level_x, level_y].');
+    if isscalar(level)
+        level = [level, level];
     end
     
-    % C++ 0-based indexing
+    % C++ 0-based indexing, an empty channel mask selects all channels;
+    % values < 1 for x_max & y_max are counted from the end of the image,
+    % which is resolved in the MEX file without querying the header first
     imroi = imroi - 1;
     channel_mask = channel_mask - 1;
+    parts = parts - 1;
     
     switch lower(pixel_type)
         case 'uint'
@@ -102,15 +109,30 @@ function [im, channel_names] = exr_read(fname, varargin)
             pixel_type = 1;
         case {'single', 'float'}
             pixel_type = 2;
+        case 'double'
+            pixel_type = 3;
         otherwise
             error('exr_read:invalid_requested_pixel_type', ...
-                'requested_pixel_type must be one of ''uint'', ''half'' or ''single''.');
+                'requested_pixel_type must be one of ''uint'', ''half'', ''single'' or ''double''.');
+    end
+    
+    switch lower(decimation)
+        case 'point'
+            average = false;
+        case 'area'
+            average = true;
+        otherwise
+            error('exr_read:invalid_decimation', ...
+                'decimation must be one of ''point'' or ''area''.');
     end
     
-    [im, channel_names] = exr_read_mex(fname, pixel_type, imroi, strides, channel_mask);
+    [im, channel_names] = exr_read_mex(fname, pixel_type, imroi, strides, ...
+        channel_mask, level, average, parts);
     
     if as_img
         im = img(im, 'wls', channel_names);
-        im.storeUserData(struct('filename', fname));
+        if ischar(fname)
+            im.storeUserData(struct('filename', fname));
+        end
     end
 end
@@ -0,0 +1,121 @@
+% *************************************************************************
+% * Copyright 2026 Sebastian Merzbach
+% *
+% * authors:
+% *  - Sebastian Merzbach <smerzbach@gmail.com>
+% *
+% * file creation date: 2026-10-16
+% *
+% * This file is part of smml.
+% *
+% * smml is free software: you can redistribute it and/or modify it under
+% * the terms of the GNU Lesser General Public License as published by the
+% * Free Software Foundation, either version 3 of the License, or (at your
+% * option) any later version.
+% *
+% * smml is distributed in the hope that it will be useful, but WITHOUT
+% * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+% * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+% * License for more details.
+% *
+% * You should have received a copy of the GNU Lesser General Public
+% * License along with smml.  If not, see <http://www.gnu.org/licenses/>.
+% *
+% *************************************************************************
+% 
+% Function for reading a sequence of images in OpenEXR format into one
+% H x W x C x F array. The files are decoded in parallel. Usage:
+%
+% [frames, channel_names, errors] = exr_read_batch(filenames, varargin)
+%
+% where filenames is a cell array of F file names and the optional
+% name-value pairs 'pixel_type', 'as_img', 'imroi', 'strides',
+% 'decimation' and 'channel_mask' have the same meaning as for exr_read()
+% and are applied to all files.
+% Returns:
+% - frames is a 4D array of floats, doubles or unsigned integers (also for half
+%   precision floats), or an img object if as_img is true
+% - channel_names is a cell array of strings holding the names of each
+%   channel
+% - errors is a F x 1 cell array holding an error message for each file
+%   that could not be read, or an empty string on success; frames of
+%   unreadable files are filled with zeros
+%
+% All files need to have the same resolution and channels (names and order).
+function [frames, channel_names, errors] = exr_read_batch(fnames, varargin)
+    % avoid expensive checks in mex_auto when it's not necessary
+    [varargin, dontbuild] = arg(varargin, 'dontbuild', false, false);
+    [varargin, pixel_type] = arg(varargin, 'pixel_type', 'single', false);
+    [varargin, as_img] = arg(varargin, 'as_img', false, false);
+    [varargin, imroi] = arg(varargin, 'imroi', [0, 0, 0, 0], false);
+    [varargin, strides] = arg(varargin, 'strides', [1, 1], false);
+    [varargin, channel_mask] = arg(varargin, 'channel_mask', [], false);
+    [varargin, decimation] = arg(varargin, 'decimation', 'point', false);
+    arg(varargin);
+    
+    % get folder containing this script
+    mdir = fileparts(mfilename('fullpath'));
+    header_dir = fullfile(mdir, '..', 'external', 'tinyexr');
+    
+    % initiate automatic MEX compilation
+    mex_auto(...
+        'dontbuild', dontbuild, ...
+        'sources', {'exr_read_batch_mex.cpp'}, ...
+        'headers', {'tinyexr.h', 'exr_chunks.h'}, ...
+        'openmp', true, ...
+        ['-I', header_dir]);
+    
+    if ischar(fnames)
+        fnames = {fnames};
+    end
+    
+    assert(numel(imroi) == 4, 'exr_read_batch:invalid_roi', ...
+        'roi must be specified as [x_min, y_min, x_max, y_max].');
+    assert(numel(strides) == 2, 'exr_read_batch:invalid_strides', ...
+        'strides must be specified as [stride_x, stride_y].');
+    
+    % C++ 0-based indexing, an empty channel mask selects all channels;
+    % values < 1 for x_max & y_max are counted from the end of the image
+    imroi = imroi - 1;
+    channel_mask = channel_mask - 1;
+    
+    switch lower(pixel_type)
+        case 'uint'
+            pixel_type = 0;
+        case 'half'
+            pixel_type = 1;
+        case {'single', 'float'}
+            pixel_type = 2;
+        case 'double'
+            pixel_type = 3;
+        otherwise
+            error('exr_read_batch:invalid_requested_pixel_type', ...
+                'requested_pixel_type must be one of ''uint'', ''half'', ''single'' or ''double''.');
+    end
+    
+    switch lower(decimation)
+        case 'point'
+            average = false;
+        case 'area'
+            average = true;
+        otherwise
+            error('exr_read_batch:invalid_decimation', ...
+                'decimation must be one of ''point'' or ''area''.');
+    end
+    
+    [frames, channel_names, errors] = exr_read_batch_mex(fnames, pixel_type, ...
+        imroi, strides, channel_mask, average);
+    
+    failed = find(~cellfun(@isempty, errors));
+    if ~isempty(failed) && nargout < 3
+        for ii = row(failed)
+            warning('exr_read_batch:read_error', 'error reading %s: %s', ...
+                fnames{ii}, errors{ii});
+        end
+    end
+    
+    if as_img
+        frames = img(frames, 'wls', channel_names);
+        frames.storeUserData(struct('filenames', {fnames}));
+    end
+end
@@ -0,0 +1,228 @@
+/**************************************************************************
+ * Copyright 2026 Sebastian Merzbach
+ *
+ * authors:
+ *  - Sebastian Merzbach <smerzbach@gmail.com>
+ *
+ * file creation date: 2026-10-16
+ *
+ * This file is part of smml.
+ *
+ * smml is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * smml is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with smml.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ **************************************************************************
+ *
+ * Mex file for reading a stack of OpenEXR images in parallel. Usage:
+ *
+ * [frames, channel_names, errors] = exr_read_batch_mex(filenames[,
+ *   pixel_type[, region_of_interest[, strides[, channel_mask[,
+ *   average]]]]]), where
+ * - filenames is a cell array of F strings
+ * - pixel_type, region_of_interest, strides, channel_mask and average are
+ *   applied to all files and have the same meaning as for exr_read_mex()
+ * Return arguments are:
+ * - frames, a H x W x C x F array of singles, doubles or unsigned integers
+ *   (uints are also used for half precision floats)
+ * - channel_names is a cell array of strings holding the names of each
+ *   channel, taken from the first readable file
+ * - errors is a F x 1 cell array of strings, holding an error message for
+ *   each file that could not be read and an empty string otherwise; the
+ *   corresponding frames are filled with zeros
+ *
+ * All files must have the same resolution and channels (names and order)
+ * as the first readable file.
+ */
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <mex.h>
+
+#define TINYEXR_IMPLEMENTATION
+#include "tinyexr.h"
+
+#include "exr_chunks.h"
+
+// decode all frames in parallel into the H x W x C x F array out, the first
+// file is already open from determining the layout
+template <typename T>
+void read_frames(exr_chunks::ExrFile& first_file,
+        const std::vector<std::string>& filenames, const double* pRoi,
+        const double* pStrides, const double* pChannelMask, size_t num_channels_mask, bool average,
+        int width, int height, const std::vector<std::string>& file_channel_names,
+        size_t frame_size, T* out, std::vector<std::string>& errors) {
+    #pragma omp parallel for schedule(dynamic)
+    for (int fi = 0; fi < (int) filenames.size(); fi++) {
+        try {
+            std::unique_ptr<exr_chunks::ExrFile> opened;
+            if (fi > 0) {
+                opened.reset(new exr_chunks::ExrFile(filenames[fi]));
+            }
+            exr_chunks::ExrFile& file = fi > 0 ? *opened : first_file;
+            if (file.width() != width || file.height() != height ||
+                    file.header().num_channels != (int) file_channel_names.size()) {
+                throw std::runtime_error("image dimensions differ from the first image.");
+            }
+            for (int ci = 0; ci < file.header().num_channels; ci++) {
+                if (file_channel_names[ci] != file.header().channels[ci].name) {
+                    throw std::runtime_error("channel names differ from the first image.");
+                }
+            }
+            exr_chunks::ReadRequest request = exr_chunks::make_request(file.header(),
+                    pRoi, pStrides, pChannelMask, num_channels_mask);
+            request.average = average;
+            exr_chunks::read_pixels(file, request, out + fi * frame_size);
+        } catch (std::exception& e) {
+            // frames that fail partway through decoding are zeroed again
+            std::fill(out + fi * frame_size, out + (fi + 1) * frame_size, T());
+            errors[fi] = e.what();
+        }
+    }
+}
+
+void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
+{
+    // check inputs
+    if(1 > nrhs || nrhs > 6) {
+        mexErrMsgTxt("Usage: [frames, channels, errors] = exr_read_batch(filenames[, requested_pixel_type[, roi[, strides[, channel_mask[, average]]]]])");
+    }
+
+    if (!mxIsCell(prhs[0]) || mxIsEmpty(prhs[0])) {
+        mexErrMsgTxt("filenames must be a non-empty cell array of strings.\n");
+    }
+
+    // read inputs
+    std::vector<std::string> filenames(mxGetNumberOfElements(prhs[0]));
+    for (size_t fi = 0; fi < filenames.size(); fi++) {
+        char* filename = mxArrayToString(mxGetCell(prhs[0], fi));
+        if (!filename) {
+            mexErrMsgTxt("filenames must be a non-empty cell array of strings.\n");
+        }
+        filenames[fi] = filename;
+        mxFree(filename);
+    }
+
+    int requested_pixel_type = TINYEXR_PIXELTYPE_FLOAT;
+    if (nrhs > 1) {
+        requested_pixel_type = mxGetScalar(prhs[1]);
+    }
+
+    if (0 > requested_pixel_type || requested_pixel_type > 3) {
+        mexErrMsgTxt("requested_pixel_type must be 0 (uint), 1 (half), 2 (float) or 3 (double).\n");
+    }
+
+    const double* pRoi = NULL;
+    if (nrhs > 2) {
+        if (mxGetNumberOfElements(prhs[2]) != 4) {
+            mexErrMsgTxt("region of interest must be specified as [x_min, y_min, x_max, y_max]\n");
+        }
+        pRoi = mxGetPr(prhs[2]);
+    }
+
+    const double* pStrides = NULL;
+    if (nrhs > 3) {
+        if (mxGetNumberOfElements(prhs[3]) != 2) {
+            mexErrMsgTxt("strides must be specified as [stride_x, stride_y]\n");
+        }
+        pStrides = mxGetPr(prhs[3]);
+    }
+
+    const double* pChannelMask = NULL;
+    size_t num_channels_mask = 0;
+    if (nrhs > 4 && !mxIsEmpty(prhs[4])) {
+        pChannelMask = mxGetPr(prhs[4]);
+        num_channels_mask = mxGetNumberOfElements(prhs[4]);
+    }
+
+    bool average = nrhs > 5 && mxGetScalar(prhs[5]) != 0;
+
+    // the first readable file determines the layout of the output array
+    std::vector<std::string> errors(filenames.size());
+    int width = 0, height = 0;
+    exr_chunks::ReadRequest request;
+    std::vector<std::string> channel_names;
+    std::vector<std::string> file_channel_names;
+    std::unique_ptr<exr_chunks::ExrFile> first_file;
+    size_t fi_first = 0;
+    for (; fi_first < filenames.size(); fi_first++) {
+        try {
+            first_file.reset(new exr_chunks::ExrFile(filenames[fi_first]));
+            exr_chunks::ExrFile& file = *first_file;
+            request = exr_chunks::make_request(file.header(), pRoi, pStrides,
+                    pChannelMask, num_channels_mask);
+            width = file.width();
+            height = file.height();
+            for (int ci = 0; ci < file.header().num_channels; ci++) {
+                file_channel_names.push_back(file.header().channels[ci].name);
+            }
+            for (size_t ci_out = 0; ci_out < request.channel_mask.size(); ci_out++) {
+                channel_names.push_back(file.header().channels[request.channel_mask[ci_out]].name);
+            }
+            break;
+        } catch (std::exception& e) {
+            errors[fi_first] = e.what();
+        }
+    }
+    if (fi_first == filenames.size()) {
+        mexErrMsgTxt((std::string("none of the files could be read, first error: ") + errors[0]).c_str());
+    }
+
+    // set dimensions of Matlab array, frames that cannot be read remain zero
+    size_t num_channels_out = request.channel_mask.size();
+    mwSize dims[4] = {request.height_out(), request.width_out(), num_channels_out, filenames.size()};
+    size_t frame_size = dims[0] * dims[1] * dims[2];
+    std::vector<std::string> remaining(filenames.begin() + fi_first, filenames.end());
+    std::vector<std::string> remaining_errors(remaining.size());
+    if (requested_pixel_type == TINYEXR_PIXELTYPE_FLOAT) {
+        plhs[0] = mxCreateNumericArray(4, dims, mxSINGLE_CLASS, mxREAL);
+        read_frames(*first_file, remaining, pRoi, pStrides, pChannelMask, num_channels_mask, average,
+                width, height, file_channel_names, frame_size,
+                (float*) mxGetData(plhs[0]) + fi_first * frame_size, remaining_errors);
+    } else if (requested_pixel_type == TINYEXR_PIXELTYPE_HALF) {
+        plhs[0] = mxCreateNumericArray(4, dims, mxUINT16_CLASS, mxREAL);
+        read_frames(*first_file, remaining, pRoi, pStrides, pChannelMask, num_channels_mask, average,
+                width, height, file_channel_names, frame_size,
+                (uint16_t*) mxGetData(plhs[0]) + fi_first * frame_size, remaining_errors);
+    } else if (requested_pixel_type == 3) {
+        plhs[0] = mxCreateNumericArray(4, dims, mxDOUBLE_CLASS, mxREAL);
+        read_frames(*first_file, remaining, pRoi, pStrides, pChannelMask, num_channels_mask, average,
+                width, height, file_channel_names, frame_size,
+                (double*) mxGetData(plhs[0]) + fi_first * frame_size, remaining_errors);
+    } else {
+        plhs[0] = mxCreateNumericArray(4, dims, mxUINT32_CLASS, mxREAL);
+        read_frames(*first_file, remaining, pRoi, pStrides, pChannelMask, num_channels_mask, average,
+                width, height, file_channel_names, frame_size,
+                (uint32_t*) mxGetData(plhs[0]) + fi_first * frame_size, remaining_errors);
+    }
+    std::copy(remaining_errors.begin(), remaining_errors.end(), errors.begin() + fi_first);
+
+    // extract channel names
+    if (nlhs > 1) {
+        plhs[1] = mxCreateCellMatrix(1, num_channels_out);
+        for (size_t ci_out = 0; ci_out < num_channels_out; ci_out++) {
+            mxSetCell(plhs[1], ci_out, mxCreateString(channel_names[ci_out].c_str()));
+        }
+    }
+
+    // per file error messages
+    if (nlhs > 2) {
+        plhs[2] = mxCreateCellMatrix(filenames.size(), 1);
+        for (size_t fi = 0; fi < filenames.size(); fi++) {
+            mxSetCell(plhs[2], fi, mxCreateString(errors[fi].c_str()));
+        }
+    }
+}
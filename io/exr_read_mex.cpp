@@ -26,22 +26,40 @@
  * Mex file for reading images in OpenEXR format. Usage:
  *
  * [image, channel_names] = exr_read_mex(filename[, pixel_type[, 
- *   region_of_interest[, strides]]]), where
+ *   region_of_interest[, strides[, channel_mask[, level[, average[,
+ *   parts]]]]]]]), where
+ * - filename is either the path to an EXR file, which is memory mapped, or
+ *   a uint8 array holding the contents of an EXR file
  * - the optional argument pixel_type determines data type the pixel values
  *   should be converted to from the pixel format stored in file, possible
- *   values are 0 (uint32), 1 (half) or 2 (float)
- * - region_of_interest is a 6 element array with [x_min, y_min, x_max,
- *   y_max, ch_min, ch_max] specifying a sub region of the pixels
- * - strides is a 3 element array specifying [x_stride, y_stride,
- *   channel_stride]
+ *   values are 0 (uint32), 1 (half), 2 (float) or 3 (double)
+ * - region_of_interest is a 4 element array with [x_min, y_min, x_max,
+ *   y_max] specifying a sub region of the pixels (0-based), negative
+ *   values for x_max and y_max are counted from the end, -1 being the
+ *   last column / row
+ * - strides is a 2 element array specifying [x_stride, y_stride]
+ * - if average is true, each output pixel holds the mean of the x_stride x
+ *   y_stride block of pixels starting at its position, accumulated in
+ *   single precision while decoding, otherwise only the first pixel of
+ *   each block is read
+ * - channel_mask holds the 0-based indices of the channels to read, all
+ *   channels are read if it is empty
+ * - level is a 2 element array [level_x, level_y] selecting the resolution
+ *   level of tiled mip or rip mapped images, region_of_interest refers to
+ *   the pixels at that level
+ * - parts holds the 0-based indices of the parts of a multipart file to
+ *   read, all parts are read if it is empty; the parts must have the same
+ *   size and channels
  * Return arguments are:
- * - image, a 2D or 3D array of floats or unsigned integers (uints are also
- *   used for half precision floats)
+ * - image, a 2D or 3D array of singles, doubles or unsigned integers (uints
+ *   are also used for half precision floats), for multipart files a 4D
+ *   array with one image per part along the 4th dimension
  * - channel_names is a cell array of strings holding the names of each
  *   channel
  */
 
 #include <cstdint>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -50,181 +68,152 @@
 #define TINYEXR_IMPLEMENTATION
 #include "tinyexr.h"
 
+#include "exr_chunks.h"
+
+// decode the same region of each part into consecutive images
+template <typename T>
+void read_parts(exr_chunks::ExrFile& file, const std::vector<exr_chunks::ReadRequest>& requests,
+        const std::vector<int>& parts, T* out) {
+    const size_t frame_size = requests[0].height_out() * requests[0].width_out() *
+            requests[0].channel_mask.size();
+    for (size_t pi = 0; pi < parts.size(); pi++) {
+        exr_chunks::read_pixels(file, requests[pi], out + pi * frame_size, parts[pi]);
+    }
+}
+
 void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
 {
     // check inputs
-    if(1 > nrhs || nrhs > 5) {
-        mexErrMsgTxt("Usage: [im, channels] = exr_read(path_to_exr_file[, requested_pixel_type[, roi[, strides[, channel_mask]]]])");
+    if(1 > nrhs || nrhs > 8) {
+        mexErrMsgTxt("Usage: [im, channels] = exr_read(path_to_exr_file[, requested_pixel_type[, roi[, strides[, channel_mask[, level[, average[, parts]]]]]]])");
     }
     
     // read inputs
-    char *filename = mxArrayToString(prhs[0]);
+    bool from_memory = mxGetClassID(prhs[0]) == mxUINT8_CLASS;
+    char *filename = from_memory ? NULL : mxArrayToString(prhs[0]);
+    if (!from_memory && !filename) {
+        mexErrMsgTxt("first input must be a file name or a uint8 array with the file contents.\n");
+    }
     
     int requested_pixel_type = TINYEXR_PIXELTYPE_FLOAT;
     if (nrhs > 1) {
         requested_pixel_type = mxGetScalar(prhs[1]);
     }
     
-    if (0 > requested_pixel_type || requested_pixel_type > 2) {
-        mexErrMsgTxt("requested_pixel_type must be 0 (uint), 1 (half) or 2 (float).\n");
+    if (0 > requested_pixel_type || requested_pixel_type > 3) {
+        mexErrMsgTxt("requested_pixel_type must be 0 (uint), 1 (half), 2 (float) or 3 (double).\n");
     }
     
-    try {
-        EXRVersion exr_version;
-        EXRImage exr_image;
-        EXRHeader exr_header;
-        InitEXRHeader(&exr_header);
-        InitEXRImage(&exr_image);
-        
-        // read EXR format from file & check for compatibility
-        int ret = ParseEXRVersionFromFile(&exr_version, filename);
-        if (ret != TINYEXR_SUCCESS) {
-            mexErrMsgTxt((std::string("Error parsing EXR version from file ") +
-                    std::string(filename) + std::string(". Not an OpenEXR file?")).c_str());
+    const double* pRoi = NULL;
+    if (nrhs > 2) {
+        if (mxGetNumberOfElements(prhs[2]) != 4) {
+            mexErrMsgTxt("region of interest must be specified as [x_min, y_min, x_max, y_max]\n");
         }
-        if (exr_version.multipart || exr_version.non_image) {
-            mexErrMsgTxt("Loading multipart or DeepImage is not supported yet.\n");
+        // [x_min, y_min, x_max, y_max]
+        pRoi = mxGetPr(prhs[2]);
+    }
+    
+    const double* pStrides = NULL;
+    if (nrhs > 3) {
+        if (mxGetNumberOfElements(prhs[3]) != 2) {
+            mexErrMsgTxt("strides must be specified as [stride_x, stride_y]\n");
         }
-        
-        // read meta data from EXR file
-        const char** err;
-        ret = ParseEXRHeaderFromFile(&exr_header, &exr_version, filename, err);
-        if (ret != TINYEXR_SUCCESS) {
-            mexErrMsgTxt("parsing header from file failed.\n");
+        // [stride_x, stride_y]
+        pStrides = mxGetPr(prhs[3]);
+    }
+    
+    // by default, all channels are read
+    const double* pChannelMask = NULL;
+    size_t num_channels_mask = 0;
+    if (nrhs > 4 && !mxIsEmpty(prhs[4])) {
+        pChannelMask = mxGetPr(prhs[4]);
+        num_channels_mask = mxGetNumberOfElements(prhs[4]);
+    }
+    
+    // full resolution by default
+    const double* pLevel = NULL;
+    if (nrhs > 5) {
+        if (mxGetNumberOfElements(prhs[5]) != 2) {
+            mexErrMsgTxt("level must be specified as [level_x, level_y]\n");
         }
-        
-        bool roi_specified = false;
-        int dw[4];
-        std::copy(&(exr_header.data_window[0]), &(exr_header.data_window[4]), &(dw[0]));
-        int roi_default[4] = {dw[0], dw[1], dw[2], dw[3]};;
-        int roi[4];
-        std::copy(&(roi_default[0]), &(roi_default[4]), &(roi[0]));
-        if (nrhs > 2) {
-            if (mxGetNumberOfElements(prhs[2]) == 4) {
-                double* pRoi = mxGetPr(prhs[2]);
-                // [x_min, y_min, x_max, y_max]
-                std::copy(&pRoi[0], &pRoi[4], &roi[0]);
-                if (roi[0] < 0 || roi[1] < 0 || roi[2] < 0 || roi[3] < 0) {
-                    roi_specified = false;
-                    std::copy(&(roi_default[0]), &(roi_default[4]), &(roi[0]));
-                } else {
-                    roi_specified = true;
+        pLevel = mxGetPr(prhs[5]);
+    }
+    
+    // point sampling by default
+    bool average = nrhs > 6 && mxGetScalar(prhs[6]) != 0;
+    
+    // all parts of multipart files by default
+    const double* pParts = NULL;
+    size_t num_parts_requested = 0;
+    if (nrhs > 7 && !mxIsEmpty(prhs[7])) {
+        pParts = mxGetPr(prhs[7]);
+        num_parts_requested = mxGetNumberOfElements(prhs[7]);
+    }
+    
+    try {
+        // the file is mapped only once, version, header and pixels are then
+        // parsed from memory
+        std::unique_ptr<exr_chunks::ExrFile> exr_file(from_memory ?
+                new exr_chunks::ExrFile((const unsigned char*) mxGetData(prhs[0]),
+                        mxGetNumberOfElements(prhs[0])) :
+                new exr_chunks::ExrFile(filename));
+        exr_chunks::ExrFile& file = *exr_file;
+        std::vector<int> parts;
+        if (pParts) {
+            for (size_t pi = 0; pi < num_parts_requested; pi++) {
+                int part = (int) pParts[pi];
+                if (part < 0 || part >= file.num_parts()) {
+                    throw std::runtime_error("part index out of range");
                 }
-            } else {
-                mexErrMsgTxt("region of interest must be specified as [x_min, y_min, x_max, y_max]\n");
+                parts.push_back(part);
             }
-        }
-        
-        int stride_x = 1;
-        int stride_y = 1;
-        if (nrhs > 3) {
-            if (mxGetNumberOfElements(prhs[3]) == 2) {
-                double* pStrides = mxGetPr(prhs[3]);
-                // [stride_x, stride_y]
-                stride_x = pStrides[0];
-                stride_y = pStrides[1];
-            } else {
-                mexErrMsgTxt("strides must be specified as [stride_x, stride_y]\n");
+        } else {
+            for (int part = 0; part < file.num_parts(); part++) {
+                parts.push_back(part);
             }
         }
+        const EXRHeader& exr_header = file.header(parts[0]);
         
-        if (roi_specified && (roi[0] < exr_header.data_window[0] ||
-                roi[1] < exr_header.data_window[1] ||
-                roi[2] > exr_header.data_window[2] ||
-                roi[3] > exr_header.data_window[3])) {
-            char buffer[1000];
-            sprintf(buffer, "region of interest out of image bounds: given roi: [%d, %d, %d, %d], img: [%d x %d x %d].\n",
-                    roi[0], roi[1], roi[2], roi[3],
-                    exr_header.data_window[2] - exr_header.data_window[0] + 1,
-                    exr_header.data_window[3] - exr_header.data_window[1] + 1,
-                    exr_header.num_channels);
-            mexErrMsgTxt(buffer);
-        }
-        
-        size_t num_channels_mask = mxGetNumberOfElements(prhs[4]);
-        std::vector<double> channelMask(num_channels_mask);
-        if (nrhs > 4) {
-            double* pChannelMask = mxGetPr(prhs[4]);
-            std::copy(&pChannelMask[0], &pChannelMask[num_channels_mask], &channelMask[0]);
-        }
-        
-        // set requested pixel type (uint, half or float)
-        for (size_t i = 0; i < exr_header.num_channels; i++) {
-            if (exr_header.pixel_types[i] == TINYEXR_PIXELTYPE_HALF) {
-                exr_header.requested_pixel_types[i] = requested_pixel_type;
+        std::vector<exr_chunks::ReadRequest> requests;
+        for (size_t pi = 0; pi < parts.size(); pi++) {
+            const EXRHeader& part_header = file.header(parts[pi]);
+            if (part_header.num_channels != exr_header.num_channels) {
+                throw std::runtime_error("all parts must have the same channels");
+            }
+            for (int ci = 0; ci < exr_header.num_channels; ci++) {
+                if (std::string(part_header.channels[ci].name) != exr_header.channels[ci].name) {
+                    throw std::runtime_error("all parts must have the same channels");
+                }
+            }
+            requests.push_back(exr_chunks::make_request(part_header,
+                    pRoi, pStrides, pChannelMask, num_channels_mask, pLevel));
+            requests.back().average = average;
+            if (requests.back().width_out() != requests[0].width_out()
+                    || requests.back().height_out() != requests[0].height_out()) {
+                throw std::runtime_error("all parts must have the same size");
             }
         }
+        const exr_chunks::ReadRequest& request = requests[0];
+        size_t num_channels_out = request.channel_mask.size();
         
-        size_t height = exr_header.data_window[3] - exr_header.data_window[1] + 1;
-        size_t width = exr_header.data_window[2] - exr_header.data_window[0] + 1;
-        size_t height_out = roi[3] - roi[1] + 1;
-        size_t width_out  = roi[2] - roi[0] + 1;
-        height_out = ceil((float)height_out / stride_y);
-        width_out = ceil((float)width_out / stride_x);
-        size_t num_channels_out = channelMask.size();
-        
-        // read pixel values from EXR file
-        ret = LoadEXRImageFromFile(&exr_image, &exr_header, filename, err);
-        if (ret != 0) {
-            mexErrMsgTxt((std::string("Load EXR error: ") + std::string(*err)).c_str());
-        }
-        
-        // set dimensions of Matlab array
-        mwSize dims[3] = {height_out, width_out, num_channels_out};
+        // set dimensions of Matlab array, one image per part
+        mwSize dims[4] = {request.height_out(), request.width_out(), num_channels_out, parts.size()};
         
-        // copy pixel values to Matlab array
+        // decode pixel values directly into the Matlab array, half precision
+        // floats are stored as uint16 in matlab
         if (requested_pixel_type == TINYEXR_PIXELTYPE_FLOAT) {
-            plhs[0] = mxCreateNumericArray(3, dims, mxSINGLE_CLASS, mxREAL);
-            float* outMatrix = (float*) mxGetData(plhs[0]);
-            float** images = (float**) exr_image.images;
-            for (size_t ci_out = 0; ci_out < channelMask.size(); ci_out++) {
-                size_t ci = channelMask[ci_out];
-                size_t x_out = 0;
-                for (size_t x = roi[0]; x <= roi[2]; x += stride_x) {
-                    size_t y_out = 0;
-                    for (size_t y = roi[1]; y <= roi[3]; y += stride_y) {
-                        outMatrix[height_out * width_out * ci_out + x_out * height_out + y_out] =
-                                images[ci][x + y * width];
-                        y_out++;
-                    }
-                    x_out++;
-                }
-            }
+            plhs[0] = mxCreateUninitNumericArray(4, dims, mxSINGLE_CLASS, mxREAL);
+            read_parts(file, requests, parts, (float*) mxGetData(plhs[0]));
         } else if (requested_pixel_type == TINYEXR_PIXELTYPE_HALF) {
-            // half precision floats are stored as uint16 in matlab
-            plhs[0] = mxCreateNumericArray(3, dims, mxUINT16_CLASS, mxREAL);
-            unsigned short* outMatrix = (unsigned short*) mxGetData(plhs[0]);
-            unsigned short** images = (unsigned short**) exr_image.images;
-            for (size_t ci_out = 0; ci_out < channelMask.size(); ci_out++) {
-                size_t ci = channelMask[ci_out];
-                size_t x_out = 0;
-                for (size_t x = roi[0]; x <= roi[2]; x += stride_x) {
-                    size_t y_out = 0;
-                    for (size_t y = roi[1]; y <= roi[3]; y += stride_y) {
-                        outMatrix[height_out * width_out * ci_out + x_out * height_out + y_out] =
-                                images[ci][x + y * width];
-                        y_out++;
-                    }
-                    x_out++;
-                }
-            }
+            plhs[0] = mxCreateUninitNumericArray(4, dims, mxUINT16_CLASS, mxREAL);
+            read_parts(file, requests, parts, (uint16_t*) mxGetData(plhs[0]));
+        } else if (requested_pixel_type == 3) {
+            // doubles are written directly, sparing a conversion in Matlab
+            plhs[0] = mxCreateUninitNumericArray(4, dims, mxDOUBLE_CLASS, mxREAL);
+            read_parts(file, requests, parts, (double*) mxGetData(plhs[0]));
         } else {
-            plhs[0] = mxCreateNumericArray(3, dims, mxUINT32_CLASS, mxREAL);
-            unsigned int* outMatrix = (unsigned int*) mxGetData(plhs[0]);
-            unsigned int** images = (unsigned int**) exr_image.images;
-            for (size_t ci_out = 0; ci_out < channelMask.size(); ci_out++) {
-                size_t ci = channelMask[ci_out];
-                size_t x_out = 0;
-                for (size_t x = roi[0]; x <= roi[2]; x += stride_x) {
-                    size_t y_out = 0;
-                    for (size_t y = roi[1]; y <= roi[3]; y += stride_y) {
-                        outMatrix[height_out * width_out * ci_out + x_out * height_out + y_out] =
-                                images[ci][x + y * width];
-                        y_out++;
-                    }
-                    x_out++;
-                }
-            }
+            plhs[0] = mxCreateUninitNumericArray(4, dims, mxUINT32_CLASS, mxREAL);
+            read_parts(file, requests, parts, (uint32_t*) mxGetData(plhs[0]));
         }
         
         // extract channel names
@@ -233,16 +222,14 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
             dims[1] = num_channels_out;
             
             plhs[1] = mxCreateCellArray(2, dims);
-            for (size_t ci_out = 0; ci_out < channelMask.size(); ci_out++) {
-                size_t ci = channelMask[ci_out];
-                mxSetCell(plhs[1], ci_out, mxDuplicateArray(mxCreateString(exr_header.channels[ci].name)));
+            for (size_t ci_out = 0; ci_out < num_channels_out; ci_out++) {
+                size_t ci = request.channel_mask[ci_out];
+                mxSetCell(plhs[1], ci_out, mxCreateString(exr_header.channels[ci].name));
             }
         }
-        
-        FreeEXRImage(&exr_image);
-        FreeEXRHeader(&exr_header);
-    } catch (std::runtime_error err) {
+    } catch (std::exception& err) {
         mexErrMsgTxt((std::string("error reading EXR file ") +
-                std::string(filename) + std::string("\n")).c_str());
+                std::string(filename ? filename : "from memory") + std::string(": ") +
+                err.what() + std::string("\n")).c_str());
     }
 }
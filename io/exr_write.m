@@ -25,10 +25,23 @@
 % 
 % Function for writing images in OpenEXR format. Usage:
 %
-% exr.write(image, filename[, write_half[, channel_names[, compression]]]),
-% where
-% - image is is a 2D or 3D array of floats, uint32s or uint16s (for half
-%   precision floats) 
+% [buffer] = exr.write(image, filename[, write_half[, channel_names[,
+% compression]]]), where
+% - image is is a 2D, 3D or 4D array of doubles, singles, uint32s or
+%   uint16s (for half precision floats), doubles are stored as singles;
+%   singles and doubles are converted to half precision while encoding
+% - filename is the path of the output file; a 4D array holds a stack of
+%   images along its 4th dimension, which is written as a multipart file
+%   with one part per image, unless filename contains a format specifier
+%   like 'frame_%04d.exr', in which case each image f = 1, 2, ... is written
+%   to the file sprintf(filename, f), these files are encoded in parallel
+%   and can be read back with exr_read_batch(); alternatively, filename may
+%   be a cell array with one path per image
+% - if the output buffer is requested, filename must be empty and the
+%   encoded file is returned as a uint8 array instead of being written to
+%   disk, which can be passed to exr_read() or exr_query(); a cell array of
+%   empty file names encodes each image of a 4D array separately and in
+%   parallel, returning a cell array of uint8 arrays
 % - the optional argument precision enforces the data to be interpreted as the
 %   specified data type, possible values are 'single', 'half' or 'uint'
 % - channel_names is a cell array of strings holding the names of each channel
@@ -38,9 +51,32 @@
 %   - zips:  zlib compression, one scan line at a time
 % 	- zip:   zlib compression, in blocks of 16 scan lines
 % 	- piz:   piz-based wavelet compression
-function exr_write(im, filename, precision, channel_names, compression, varargin)
+% - the optional name-value pair 'num_threads' sets the number of threads
+%   compressing blocks of scan lines or tiles in parallel, by default all
+%   cores are used
+% - the optional name-value pair 'tile_size' (scalar or [width, height])
+%   writes a tiled image instead of scan lines
+% - the optional name-value pair 'levels' is one of 'one' (default),
+%   'mipmap' or 'ripmap', for mip and rip maps all lower resolution levels
+%   are computed by box filtering while writing; if no tile size is given,
+%   64 x 64 tiles are used
+% - the optional name-value pair 'rounding' is 'down' (default) or 'up' and
+%   selects how the level sizes of mip and rip maps are rounded
+% - if the optional name-value pair 'async' is true, the image is copied
+%   and written by background threads while the function returns
+%   immediately; errors of these writes are reported by exr_write_flush(),
+%   which also waits until all files have been written
+% - the optional name-value pair 'part_names' is a cell array of unique
+%   names of the parts of a multipart file, by default '1', '2', ...
+function buffer = exr_write(im, filename, precision, channel_names, compression, varargin)
     % avoid expensive checks in mex_auto when it's not necessary
     [varargin, dontbuild] = arg(varargin, 'dontbuild', false, false);
+    [varargin, num_threads] = arg(varargin, 'num_threads', 0, false);
+    [varargin, tile_size] = arg(varargin, 'tile_size', [], false);
+    [varargin, levels] = arg(varargin, 'levels', 'one', false);
+    [varargin, rounding] = arg(varargin, 'rounding', 'down', false);
+    [varargin, async] = arg(varargin, 'async', false, false);
+    [varargin, part_names] = arg(varargin, 'part_names', {}, false);
     arg(varargin);
     
     % get folder containing this script
@@ -51,7 +87,8 @@ function exr_write(im, filename, precision, channel_names, compression, varargin
     mex_auto(...
         'dontbuild', dontbuild, ...
         'sources', {'exr_write_mex.cpp'}, ...
-        'headers', {'tinyexr.h'}, ...
+        'headers', {'tinyexr.h', 'exr_chunks.h', 'exr_encode.h'}, ...
+        'openmp', true, ...
         ['-I', header_dir]);
     
     if isa(im, 'img')
@@ -82,11 +119,6 @@ function exr_write(im, filename, precision, channel_names, compression, varargin
         precision = 2;
     end
     
-    % OpenEXR only supports single floats as highest precision data type
-    if isa(im, 'double')
-        im = single(im);
-    end
-    
     if ~exist('channel_names', 'var') || isempty(channel_names)
         if size(im, 3) == 1
             channel_names = {'L'};
@@ -98,6 +130,8 @@ function exr_write(im, filename, precision, channel_names, compression, varargin
         end
     end
     
+    % OpenEXR stores channels in alphabetical order, the MEX file sorts the
+    % channels by their names without copying the image
     if exist('channel_names', 'var') && isnumeric(channel_names) && numel(channel_names) == size(im, 3)
         channel_names = cellfun(@num2str, num2cell(channel_names), 'UniformOutput', false);
     end
@@ -113,17 +147,18 @@ function exr_write(im, filename, precision, channel_names, compression, varargin
     if precision == 0 && ~isa(im, 'uint32')
         im = uint32(im);
     elseif precision == 1 && ~isa(im, 'uint16')
-        if isfloat(im)
-            im = halfprecision(im);
-        elseif isa(im, 'int16')
+        % single and double arrays are converted to half precision in the
+        % MEX file while encoding
+        if isa(im, 'int16')
             warning('exrwrite:halfprecision', ...
                 'converting int16 to uint16');
             im = typecast(im, 'uint16');
-        else
+        elseif ~isfloat(im)
             error('exrwrite:nohalfprecision', ...
                 'image is not in float or uint16 format');
         end
-    elseif precision == 2 && ~isa(im, 'single')
+    elseif precision == 2 && ~isfloat(im)
+        % double arrays are stored as floats by the MEX file
         im = single(im);
     end
     
@@ -157,12 +192,47 @@ function exr_write(im, filename, precision, channel_names, compression, varargin
         end
     end
     
-    % OpenEXR has the great design choice to store channels in alphabetical
-    % order, if we use the low-level API in the mex, this assumption is violated
-    % and can cause problems when reading the file, hence we have to sort
-    % ourselves here...
-    [channel_names, perm] = sort(channel_names);
-    im = im(:, :, perm);
+    switch lower(levels)
+        case 'one'
+            level_mode = 0;
+        case 'mipmap'
+            level_mode = 1;
+        case 'ripmap'
+            level_mode = 2;
+        otherwise
+            error('exr_write:invalid_levels', ...
+                'levels must be one of ''one'', ''mipmap'' or ''ripmap''.');
+    end
+    if level_mode ~= 0 && isempty(tile_size)
+        tile_size = 64;
+    end
+    if isscalar(tile_size)
+        tile_size = [tile_size, tile_size];
+    end
+    switch lower(rounding)
+        case 'down'
+            rounding_mode = 0;
+        case 'up'
+            rounding_mode = 1;
+        otherwise
+            error('exr_write:invalid_rounding', ...
+                'rounding must be either ''down'' or ''up''.');
+    end
+    
+    num_images = size(im, 4);
+    if ischar(filename) && num_images > 1 && any(filename == '%')
+        filename = arrayfun(@(f) sprintf(filename, f), 1 : num_images, ...
+            'UniformOutput', false);
+    end
+    if ischar(part_names)
+        part_names = {part_names};
+    end
     
-    exr_write_mex(im, filename, precision(1), channel_names, compression);
+    if nargout > 0
+        buffer = exr_write_mex(im, filename, precision(1), channel_names, compression, ...
+            num_threads, double(tile_size), level_mode, rounding_mode, async, part_names);
+    else
+        exr_write_mex(im, filename, precision(1), channel_names, compression, num_threads, ...
+            double(tile_size), level_mode, rounding_mode, async, part_names);
+    end
 end
@@ -0,0 +1,38 @@
+% *************************************************************************
+% * Copyright 2026 Sebastian Merzbach
+% *
+% * authors:
+% *  - Sebastian Merzbach <smerzbach@gmail.com>
+% *
+% * file creation date: 2026-10-16
+% *
+% * This file is part of smml.
+% *
+% * smml is free software: you can redistribute it and/or modify it under
+% * the terms of the GNU Lesser General Public License as published by the
+% * Free Software Foundation, either version 3 of the License, or (at your
+% * option) any later version.
+% *
+% * smml is distributed in the hope that it will be useful, but WITHOUT
+% * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+% * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+% * License for more details.
+% *
+% * You should have received a copy of the GNU Lesser General Public
+% * License along with smml.  If not, see <http://www.gnu.org/licenses/>.
+% *
+% *************************************************************************
+% *************************************************************************
+%
+% Wait until all images passed to exr_write() with 'async' set to true have
+% been written. If any of these writes failed, an error listing the
+% affected files is raised. Usage:
+%
+% exr_write_flush()
+function exr_write_flush()
+    % the background writers live in the MEX file of exr_write(), which
+    % also builds it; if it has not been built yet, nothing was written
+    if exist('exr_write_mex', 'file') == 3
+        exr_write_mex('flush');
+    end
+end
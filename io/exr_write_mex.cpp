@@ -25,75 +25,379 @@
  *
  * Mex file for writing images in OpenEXR format. Usage:
  *
- * exr_write_mex(image, filename[, output_pixel_type[, ...
- *    write_half[, channel_names]]]),
+ * [buffer] = exr_write_mex(image, filename, output_pixel_type,
+ *    channel_names, compression[, num_threads[, tile_size, level_mode,
+ *    rounding_mode[, async[, part_names]]]]),
  *
  * where:
- * - image is is a 2D or 3D array of floats, uint32s or uint16s (for half
- *   precision floats)
- * - the optional argument output_pixel_type enforces the data to be
- *   written as the specified data type, possible values are 'single',
- *   'half' or 'uint'
+ * - image is is a 2D, 3D or 4D array of singles, doubles, uint32s or
+ *   uint16s (for half precision floats), a 4D array holds F images along
+ *   its last dimension
+ * - filename is a string, or for 4D arrays a cell array of F strings to
+ *   write one file per image, these files are encoded in parallel;
+ *   otherwise, 4D arrays are written as a multipart file with one part per
+ *   image
+ * - if the output buffer is requested, filename must be empty (or a cell
+ *   array of empty file names) and the encoded file is returned as a uint8
+ *   array (or a cell array of one uint8 array per image) instead of being
+ *   written to disk
+ * - output_pixel_type enforces the data to be written as the specified
+ *   data type, possible values are 0 (uint), 1 (half) or 2 (float);
+ *   single and double arrays can be written as half precision floats
+ *   directly, double arrays are stored as floats
  * - channel_names is a cell array of strings holding the names of each
- *   channel
+ *   channel, the channels are sorted alphabetically by the names in the
+ *   file
+ * - compression is one of 0 (none), 1 (rle), 2 (zips), 3 (zip) or 4 (piz)
+ * - num_threads is the number of threads compressing blocks of scan lines
+ *   or tiles in parallel, 0 (default) uses all available cores
+ * - tile_size is empty for scan line images (default) or [width, height]
+ *   of the tiles of a tiled image
+ * - level_mode is 0 for a single level, 1 for mip maps or 2 for rip maps,
+ *   the lower resolution levels are computed by box filtering
+ * - rounding_mode selects how level sizes are rounded, 0 (down) or 1 (up)
+ * - if async is true, the image is copied and the call returns
+ *   immediately, the file is written by a pool of background threads that
+ *   persists across calls; if too many writes are pending, the call blocks
+ *   until one of them has finished
+ * - part_names is a cell array of F unique names of the parts of a
+ *   multipart file, by default the parts are named 1, ..., F
+ *
+ * exr_write_mex('flush') waits until all asynchronous writes have finished
+ * and raises an error listing all files that could not be written. Pending
+ * writes are also completed when the MEX file is cleared, their errors are
+ * then reported as warnings.
  */
 
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <set>
 #include <string>
+#include <thread>
+#include <utility>
 #include <vector>
 
 #include <mex.h>
 
 #define TINYEXR_IMPLEMENTATION
-#include "../external/tinyexr/tinyexr.h"
+#include "tinyexr.h"
+
+#include "exr_chunks.h"
+#include "exr_encode.h"
+
+// everything needed to write one file with one image per part, the
+// images are stored one after the other in data, which is referenced for
+// synchronous writes and owned by the job for asynchronous ones
+struct WriteJob {
+    std::string filename;
+    // encode to the buffer instead of writing filename
+    bool to_memory;
+    std::vector<unsigned char> encoded;
+    std::vector<exr_chunks::WriteLayout> parts;
+    std::vector<int> channel_order;
+    int num_threads;
+    mxClassID class_id;
+    const void* data;
+    std::vector<unsigned char> owned_data;
+};
+
+template <typename T>
+void write_image(const T* data, const std::vector<int>& channel_order,
+        const std::vector<exr_chunks::WriteLayout>& parts, int num_threads,
+        exr_chunks::Sink& sink) {
+    const size_t part_size = (size_t) parts[0].width * parts[0].height * channel_order.size();
+    std::vector<exr_chunks::ColumnMajorSource<T> > sources;
+    for (size_t pi = 0; pi < parts.size(); pi++) {
+        sources.push_back(exr_chunks::ColumnMajorSource<T>(data + pi * part_size,
+                parts[pi].width, parts[pi].height, channel_order));
+    }
+    exr_chunks::write_file(sources, parts, num_threads, sink);
+}
+
+// compress blocks of scan lines or tiles in parallel and write them in
+// order, the samples are transposed and converted block-wise while encoding
+void encode(const WriteJob& job, exr_chunks::Sink& sink) {
+    switch (job.class_id) {
+        case mxSINGLE_CLASS:
+            write_image((const float*) job.data, job.channel_order, job.parts, job.num_threads, sink);
+            break;
+        case mxDOUBLE_CLASS:
+            write_image((const double*) job.data, job.channel_order, job.parts, job.num_threads, sink);
+            break;
+        case mxUINT16_CLASS:
+            write_image((const uint16_t*) job.data, job.channel_order, job.parts, job.num_threads, sink);
+            break;
+        default:
+            write_image((const uint32_t*) job.data, job.channel_order, job.parts, job.num_threads, sink);
+    }
+}
+
+void run(WriteJob& job) {
+    if (job.to_memory) {
+        exr_chunks::MemorySink sink(job.encoded);
+        // the uncompressed size is an upper bound for most images
+        job.encoded.reserve(job.parts.size() * job.parts[0].width * job.parts[0].height *
+                job.parts[0].pixel_size() + 4096);
+        encode(job, sink);
+        return;
+    }
+    exr_chunks::FileSink sink(job.filename);
+    encode(job, sink);
+    sink.close();
+}
+
+// Background threads writing queued images, each image is still encoded in
+// parallel. No Matlab API functions are called from the worker threads.
+class WriterPool {
+public:
+    explicit WriterPool(int num_workers) : max_pending_(4 * num_workers), active_(0), stop_(false) {
+        for (int ii = 0; ii < num_workers; ii++) {
+            workers_.push_back(std::thread(&WriterPool::work, this));
+        }
+    }
+
+    ~WriterPool() {
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        job_available_.notify_all();
+        for (size_t ii = 0; ii < workers_.size(); ii++) {
+            workers_[ii].join();
+        }
+    }
+
+    // queue a job, blocks while too many jobs are pending so that the
+    // copied images do not exhaust the memory
+    void submit(std::unique_ptr<WriteJob> job) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (queue_.size() + active_ >= max_pending_) {
+            job_done_.wait(lock);
+        }
+        queue_.push_back(std::move(job));
+        job_available_.notify_one();
+    }
+
+    // wait for all queued jobs, returns and clears the errors since the
+    // last call
+    std::vector<std::string> wait() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (!queue_.empty() || active_ > 0) {
+            job_done_.wait(lock);
+        }
+        std::vector<std::string> errors;
+        errors.swap(errors_);
+        return errors;
+    }
 
-#ifdef _MSC_VER
-#define strncpy_s strncpy
-#endif
+private:
+    WriterPool(const WriterPool&);
+    WriterPool& operator=(const WriterPool&);
+
+    void work() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            while (!stop_ && queue_.empty()) {
+                job_available_.wait(lock);
+            }
+            // remaining jobs are finished before stopping
+            if (queue_.empty()) {
+                return;
+            }
+            std::unique_ptr<WriteJob> job = std::move(queue_.front());
+            queue_.pop_front();
+            active_++;
+            lock.unlock();
+
+            std::string error;
+            try {
+                run(*job);
+            } catch (std::exception& err) {
+                error = job->filename + ": " + err.what();
+            }
+            job.reset();
+
+            lock.lock();
+            if (!error.empty()) {
+                errors_.push_back(error);
+            }
+            active_--;
+            job_done_.notify_all();
+        }
+    }
+
+    const size_t max_pending_;
+    std::mutex mutex_;
+    std::condition_variable job_available_;
+    std::condition_variable job_done_;
+    std::deque<std::unique_ptr<WriteJob> > queue_;
+    size_t active_;
+    bool stop_;
+    std::vector<std::string> errors_;
+    std::vector<std::thread> workers_;
+};
+
+// number of images written concurrently in the background
+static const int num_async_workers = 2;
+
+static std::unique_ptr<WriterPool> writer_pool;
+
+// complete pending writes when the MEX file is cleared
+static void atExit() {
+    if (writer_pool) {
+        std::vector<std::string> errors = writer_pool->wait();
+        for (size_t ii = 0; ii < errors.size(); ii++) {
+            mexWarnMsgTxt(("error in writing EXR file " + errors[ii]).c_str());
+        }
+        writer_pool.reset();
+    }
+}
+
+// wait for all asynchronous writes and report their errors
+void flush() {
+    if (!writer_pool) {
+        return;
+    }
+    std::vector<std::string> errors = writer_pool->wait();
+    if (!errors.empty()) {
+        std::string message = "error in writing EXR files:";
+        for (size_t ii = 0; ii < errors.size(); ii++) {
+            message += "\n" + errors[ii];
+        }
+        mexErrMsgTxt(message.c_str());
+    }
+}
 
 void mexFunction(int nlhs, mxArray *plhs[],int nrhs, const mxArray *prhs[]) {
+    mexAtExit(atExit);
+    
     // check & parse inputs
-    if (nlhs != 0) {
-        mexErrMsgTxt("Function does not return any outputs.");
+    if (nlhs > 1) {
+        mexErrMsgTxt("Function returns at most one output.");
+    }
+    
+    if (nrhs == 1 && mxIsChar(prhs[0])) {
+        char* mode = mxArrayToString(prhs[0]);
+        std::string str_mode(mode);
+        mxFree(mode);
+        if (str_mode != "flush" || nlhs != 0) {
+            mexErrMsgTxt(("unknown mode " + str_mode + ", only 'flush' is supported.").c_str());
+        }
+        flush();
+        return;
     }
     
-    if (nrhs != 5) {
-        mexErrMsgTxt("Usage: exr.write_mex(image, filename, output_pixel_type, channel_names, compression);");
+    if (nrhs != 5 && nrhs != 6 && nrhs != 9 && nrhs != 10 && nrhs != 11) {
+        mexErrMsgTxt("Usage: [buffer] = exr.write_mex(image, filename, output_pixel_type, channel_names, compression[, num_threads[, tile_size, level_mode, rounding_mode[, async[, part_names]]]]); or exr_write_mex('flush');");
     }
     
-    if (!mxIsChar(prhs[1])) {
-        mexErrMsgTxt("Second input argument must be a string.");
+    if (!mxIsChar(prhs[1]) && !mxIsCell(prhs[1]) && !mxIsEmpty(prhs[1])) {
+        mexErrMsgTxt("Second input argument must be a string or a cell array of strings.");
     }
     
     if (!mxIsCell(prhs[3]) || mxIsEmpty(prhs[3])) {
         mexErrMsgTxt("input must either be M x N x 3 or M x N x P and a cell array of P strings specifying the channel names.");
     }
     
-    char *filename = mxArrayToString(prhs[1]);
     int output_pixel_type = (int) mxGetScalar(prhs[2]); // 0: UINT, 1: HALF, 2: FLOAT
     const mxArray* mx_channels = prhs[3];
     mwSize num_channel_names = mxGetNumberOfElements(mx_channels);
     int compression = (int) mxGetScalar(prhs[4]);
+    int num_threads = nrhs > 5 ? (int) mxGetScalar(prhs[5]) : 0;
+    bool tiled = nrhs > 6 && !mxIsEmpty(prhs[6]);
+    int tile_size[2] = {0, 0};
+    int level_mode = nrhs > 7 ? (int) mxGetScalar(prhs[7]) : 0;
+    int rounding_mode = nrhs > 8 ? (int) mxGetScalar(prhs[8]) : 0;
+    bool async = nrhs > 9 && mxGetScalar(prhs[9]) != 0;
     
     int ndims = mxGetNumberOfDimensions(prhs[0]);
-    if (ndims < 2 || ndims > 3) {
-        mexErrMsgTxt("First input argument must be a 2D or 3D array.");
+    if (ndims < 2 || ndims > 4) {
+        mexErrMsgTxt("First input argument must be a 2D, 3D or 4D array.");
     }
     const mwSize* dims = mxGetDimensions(prhs[0]);
     size_t height = dims[0];
     size_t width = dims[1];
     size_t num_channels = 1;
-    if (ndims == 3 && mxIsCell(prhs[3])) {
+    if (ndims >= 3 && mxIsCell(prhs[3])) {
         num_channels = dims[2];
     }
+    size_t num_images = ndims == 4 ? dims[3] : 1;
+    
+    if (width < 1 || height < 1) {
+        mexErrMsgTxt("input image must have at least one pixel.");
+    }
+    
+    // one file per image or one file with a part per image, empty file
+    // names are returned in memory
+    std::vector<std::string> filenames;
+    if (mxIsCell(prhs[1])) {
+        if (mxGetNumberOfElements(prhs[1]) != num_images) {
+            mexErrMsgTxt("The number of file names must match the number of images along the 4th dimension.");
+        }
+        for (size_t fi = 0; fi < num_images; fi++) {
+            const mxArray* mx_filename = mxGetCell(prhs[1], fi);
+            char* filename = mx_filename && !mxIsEmpty(mx_filename) ? mxArrayToString(mx_filename) : NULL;
+            if (mx_filename && !mxIsEmpty(mx_filename) && !filename) {
+                mexErrMsgTxt("file names must be strings.");
+            }
+            filenames.push_back(filename ? filename : "");
+            mxFree(filename);
+        }
+    } else if (!mxIsEmpty(prhs[1])) {
+        char* filename = mxArrayToString(prhs[1]);
+        filenames.push_back(filename);
+        mxFree(filename);
+    } else {
+        filenames.push_back("");
+    }
+    const bool multipart = filenames.size() == 1 && num_images > 1;
+    const bool to_memory = nlhs > 0;
+    for (size_t fi = 0; fi < filenames.size(); fi++) {
+        if (filenames[fi].empty() != to_memory) {
+            mexErrMsgTxt(to_memory ? "filename must be empty when the encoded file is returned." :
+                    "filename must not be empty.");
+        }
+    }
+    if (to_memory && async) {
+        mexErrMsgTxt("in-memory encoding cannot be asynchronous.");
+    }
+    
+    std::vector<std::string> part_names;
+    if (nrhs > 10 && !mxIsEmpty(prhs[10])) {
+        if (!mxIsCell(prhs[10]) || mxGetNumberOfElements(prhs[10]) != num_images) {
+            mexErrMsgTxt("part_names must be a cell array with one name per image.");
+        }
+        for (size_t pi = 0; pi < num_images; pi++) {
+            char* part_name = mxArrayToString(mxGetCell(prhs[10], pi));
+            if (!part_name) {
+                mexErrMsgTxt("part names must be strings.");
+            }
+            part_names.push_back(part_name);
+            mxFree(part_name);
+        }
+    } else {
+        for (size_t pi = 0; pi < num_images; pi++) {
+            part_names.push_back(std::to_string(pi + 1));
+        }
+    }
+    if (std::set<std::string>(part_names.begin(), part_names.end()).size() != part_names.size()) {
+        mexErrMsgTxt("part names must be unique.");
+    }
     
     if (num_channels != num_channel_names) {
         mexErrMsgTxt("Number of image channels must match number of channel names!");
     }
     
     if (mxGetClassID(prhs[0]) != mxSINGLE_CLASS
+            && mxGetClassID(prhs[0]) != mxDOUBLE_CLASS
             && mxGetClassID(prhs[0]) != mxUINT16_CLASS
             && mxGetClassID(prhs[0]) != mxUINT32_CLASS) {
-        mexErrMsgTxt("First input argument must be in single or uint16 precision.");
+        mexErrMsgTxt("First input argument must be in single, double, uint16 (half) or uint32 precision.");
     }
     
     // conversion from lower to higher precision doesn't make sense (except for uint16 -> uint32)
@@ -103,110 +407,137 @@ void mexFunction(int nlhs, mxArray *plhs[],int nrhs, const mxArray *prhs[]) {
         mexErrMsgTxt("If the image array is in uint16 (or half) or uint32 format, precision must be set to 'half' or 'uint'.");
     }
     
+    if (output_pixel_type < TINYEXR_PIXELTYPE_UINT || output_pixel_type > TINYEXR_PIXELTYPE_FLOAT) {
+        mexErrMsgTxt("output pixel type must be 0 (uint), 1 (half) or 2 (float).");
+    }
+    
     if (!mxIsScalar(prhs[4]) || 0 > compression || compression > 4) {
         mexErrMsgTxt("compression argument must be an integer between 0 and 4.");
     }
     
-    // assume at least 16x16 pixels
-    if (width < 16 || height < 16) {
-        mexErrMsgTxt("input image must be at least 16x16 pixels.");
-    }
-    
-    EXRHeader header;
-    EXRImage image;
-    InitEXRHeader(&header);
-    InitEXRImage(&image);
-    
-    image.width = width;
-    image.height = height;
-    image.num_channels = num_channels;
-    
-    // convert Matlab's column-major to row-major format & provide pointers per channel
-    std::vector<unsigned char*> image_ptrs(num_channels);
-    std::vector<float> data_float;
-    std::vector<uint16_t> data_half;
-    std::vector<uint32_t> data_uint;
-    int pixel_type = -1;
-    if (mxGetClassID(prhs[0]) == mxSINGLE_CLASS) {
-        pixel_type = TINYEXR_PIXELTYPE_FLOAT;
-        float* data = (float*) mxGetData(prhs[0]);
-        data_float.resize(height * width * num_channels);
-        for (size_t ci = 0; ci < num_channels; ci++) {
-            // transpose x and y
-            for (size_t y = 0; y < height; y++) {
-                for (size_t x = 0; x < width; x++) {
-                    data_float[ci * height * width + y * width + x] = 
-                            data[ci * height * width + x * height + y];
-                }
-            }
-            image_ptrs[ci] = (unsigned char*) (&(data_float[ci * width * height]));
-        }
-    } else if (mxGetClassID(prhs[0]) == mxUINT16_CLASS) {
-        pixel_type = TINYEXR_PIXELTYPE_HALF;
-        uint16_t* data = (uint16_t*) mxGetData(prhs[0]);
-        data_half.resize(height * width * num_channels);
-        for (size_t ci = 0; ci < num_channels; ci++) {
-            // transpose x and y
-            for (size_t y = 0; y < height; y++) {
-                for (size_t x = 0; x < width; x++) {
-                    data_half[ci * height * width + y * width + x] = 
-                            data[ci * height * width + x * height + y];
-                }
-            }
-            image_ptrs[ci] = (unsigned char*) (&(data_half[ci * width * height]));
-        }
-    } else if (mxGetClassID(prhs[0]) == mxUINT32_CLASS) {
-        pixel_type = TINYEXR_PIXELTYPE_UINT;
-        uint32_t* data = (uint32_t*) mxGetData(prhs[0]);
-        data_uint.resize(height * width * num_channels);
-        for (size_t ci = 0; ci < num_channels; ci++) {
-            // transpose x and y
-            for (size_t y = 0; y < height; y++) {
-                for (size_t x = 0; x < width; x++) {
-                    data_uint[ci * height * width + y * width + x] = 
-                            data[ci * height * width + x * height + y];
-                }
-            }
-            image_ptrs[ci] = (unsigned char*) (&(data_uint[ci * width * height]));
+    if (num_threads < 0) {
+        mexErrMsgTxt("num_threads must be a non-negative integer.");
+    }
+    
+    if (tiled) {
+        if (mxGetNumberOfElements(prhs[6]) != 2 || !mxIsDouble(prhs[6])) {
+            mexErrMsgTxt("tile_size must be a 2-element vector [width, height].");
         }
-    } else {
-        mexErrMsgTxt("unsupported pixel type, must be single, uint16 (half) or uint32.\n");
+        tile_size[0] = (int) mxGetPr(prhs[6])[0];
+        tile_size[1] = (int) mxGetPr(prhs[6])[1];
+        if (tile_size[0] < 1 || tile_size[1] < 1) {
+            mexErrMsgTxt("tile_size must be positive.");
+        }
+    }
+    
+    if (0 > level_mode || level_mode > 2 || (level_mode != 0 && !tiled)) {
+        mexErrMsgTxt("level_mode must be 0 (one level), 1 (mip map) or 2 (rip map), mip and rip maps require a tile size.");
+    }
+    
+    if (0 > rounding_mode || rounding_mode > 1) {
+        mexErrMsgTxt("rounding_mode must be 0 (down) or 1 (up).");
     }
-    image.images = &(image_ptrs[0]);
     
-    // set channel names & formats
-    header.num_channels = num_channels;
-    header.channels = new EXRChannelInfo[num_channels];
-    header.pixel_types = new int[num_channels];
-    header.requested_pixel_types = new int[num_channels];
+    // set channel names & formats, the channels are stored in alphabetical
+    // order in the file
+    std::vector<std::pair<std::string, int> > sorted_channels(num_channels);
     for (size_t ci = 0; ci < num_channels; ci++) {
         char* channel_name = mxArrayToString(mxGetCell(mx_channels, ci));
-        strncpy(header.channels[ci].name, channel_name, 255);
-        
-        // set input pixel format
-        header.pixel_types[ci] = pixel_type;
+        if (!channel_name) {
+            mexErrMsgTxt("channel names must be strings.");
+        }
+        sorted_channels[ci] = std::make_pair(std::string(channel_name).substr(0, 255), (int) ci);
+        mxFree(channel_name);
+    }
+    std::sort(sorted_channels.begin(), sorted_channels.end());
+    
+    exr_chunks::WriteLayout layout;
+    layout.width = width;
+    layout.height = height;
+    layout.compression = compression;
+    layout.tiled = tiled;
+    layout.tile_size_x = tile_size[0];
+    layout.tile_size_y = tile_size[1];
+    layout.level_mode = level_mode;
+    layout.rounding_mode = rounding_mode;
+    std::vector<int> channel_order(num_channels);
+    for (size_t ci = 0; ci < num_channels; ci++) {
+        layout.channel_names.push_back(sorted_channels[ci].first);
+        channel_order[ci] = sorted_channels[ci].second;
         
         // set file storage format
-        header.requested_pixel_types[ci] = output_pixel_type;
+        layout.pixel_types.push_back(output_pixel_type);
     }
     
-    // set compression type
-    header.compression_type = compression;
+    // one job per file
+    const size_t image_size = width * height * num_channels * mxGetElementSize(prhs[0]);
+    std::vector<std::unique_ptr<WriteJob> > jobs(filenames.size());
+    for (size_t fi = 0; fi < filenames.size(); fi++) {
+        jobs[fi].reset(new WriteJob());
+        WriteJob& job = *jobs[fi];
+        job.filename = filenames[fi];
+        job.to_memory = to_memory;
+        job.parts.assign(multipart ? num_images : 1, layout);
+        for (size_t pi = 0; multipart && pi < num_images; pi++) {
+            job.parts[pi].part_name = part_names[pi];
+        }
+        job.channel_order = channel_order;
+        // files are encoded in parallel instead of their chunks
+        job.num_threads = filenames.size() > 1 ? 1 : num_threads;
+        job.class_id = mxGetClassID(prhs[0]);
+        job.data = (const unsigned char*) mxGetData(prhs[0]) + fi * image_size;
+    }
+    
+    if (async) {
+        if (!writer_pool) {
+            writer_pool.reset(new WriterPool(num_async_workers));
+        }
+        for (size_t fi = 0; fi < jobs.size(); fi++) {
+            // the Matlab array may change or be freed once we return
+            const unsigned char* data = (const unsigned char*) jobs[fi]->data;
+            jobs[fi]->owned_data.assign(data, data + image_size * jobs[fi]->parts.size());
+            jobs[fi]->data = &jobs[fi]->owned_data[0];
+            jobs[fi]->num_threads = num_threads;
+            writer_pool->submit(std::move(jobs[fi]));
+        }
+        return;
+    }
     
-    const char *err;
-    int ret;
-    try {
-        ret = SaveEXRImageToFile(&image, &header, filename, &err);
-    } catch (std::exception err) {
-        mexErrMsgTxt((std::string("error in writing EXR file: ") + err.what()).c_str());
+    std::vector<std::string> errors(jobs.size());
+    #pragma omp parallel for schedule(dynamic) num_threads(exr_chunks::encoder_threads(num_threads)) if (jobs.size() > 1)
+    for (int fi = 0; fi < (int) jobs.size(); fi++) {
+        try {
+            run(*jobs[fi]);
+        } catch (std::exception& err) {
+            errors[fi] = err.what();
+        }
     }
-    if (ret != TINYEXR_SUCCESS) {
-        mexErrMsgTxt((std::string("error in writing EXR file ") + std::string(filename) + 
-                std::string(", return code: ") + std::to_string(ret) + 
-                std::string(", error message: ") + std::string(err)).c_str());
+    for (size_t fi = 0; fi < jobs.size(); fi++) {
+        if (!errors[fi].empty()) {
+            mexErrMsgTxt((std::string("error in writing EXR file ") +
+                    (to_memory ? std::string("to memory") : jobs[fi]->filename) +
+                    std::string(": ") + errors[fi]).c_str());
+        }
     }
     
-    delete[] header.channels;
-    delete[] header.pixel_types;
-    delete[] header.requested_pixel_types;
+    if (to_memory) {
+        // a single array for one file, otherwise a cell array matching the
+        // file names
+        std::vector<mxArray*> buffers(jobs.size());
+        for (size_t fi = 0; fi < jobs.size(); fi++) {
+            const std::vector<unsigned char>& encoded = jobs[fi]->encoded;
+            buffers[fi] = mxCreateUninitNumericMatrix(encoded.size(), 1, mxUINT8_CLASS, mxREAL);
+            memcpy(mxGetData(buffers[fi]), &encoded[0], encoded.size());
+            jobs[fi].reset();
+        }
+        if (mxIsCell(prhs[1])) {
+            plhs[0] = mxCreateCellArray(mxGetNumberOfDimensions(prhs[1]), mxGetDimensions(prhs[1]));
+            for (size_t fi = 0; fi < buffers.size(); fi++) {
+                mxSetCell(plhs[0], fi, buffers[fi]);
+            }
+        } else {
+            plhs[0] = buffers[0];
+        }
+    }
 }
+
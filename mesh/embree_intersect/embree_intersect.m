@@ -45,6 +45,97 @@
 %
 % intersections2 = embree_intersect('ray_origins', ray_origins2, ...
 %     'ray_dirs', ray_dirs2);
+%
+% Each call providing geometry replaces the previously loaded geometry. To
+% keep several scenes resident without rebuilding them, request a scene
+% handle when loading the geometry and pass it to the queries, the scene
+% stays in memory until it is released (or the MEX file is cleared):
+%
+% scene1 = embree_intersect('vertices', vertices1, 'faces', faces1);
+% scene2 = embree_intersect('vertices', vertices2, 'faces', faces2);
+% intersections1 = embree_intersect('scene', scene1, ...
+%     'ray_origins', ray_origins, 'ray_dirs', ray_dirs);
+% intersections2 = embree_intersect('scene', scene2, ...
+%     'ray_origins', ray_origins, 'ray_dirs', ray_dirs);
+% embree_intersect('release', [scene1, scene2]);
+%
+% embree_intersect('release', true) releases all scenes.
+%
+% For animated meshes, load the geometry with 'dynamic' set to true and
+% replace the vertex positions of each frame with 'update', which only
+% refits the BVH instead of rebuilding it; the topology must not change,
+% empty cells keep the vertices of the corresponding mesh:
+%
+% scene = embree_intersect('vertices', {V1; V2}, 'faces', {F1; F2}, ...
+%     'dynamic', true);
+% embree_intersect('scene', scene, 'update', {V1_frame2; []});
+%
+% Many copies of the same mesh can be placed with 'instance_of', which
+% takes K scene handles and a 3 x 4 x K array of transforms [R, t] from
+% object to world space; the instanced scenes are stored only once and
+% must not be released before the scene instancing them. The 'instances'
+% field of the intersections holds the index of the hit instance (0-based,
+% -1 for misses), normals are returned in world space:
+%
+% prototype = embree_intersect('vertices', V, 'faces', F);
+% scene = embree_intersect('instance_of', [prototype, prototype], ...
+%     'transforms', cat(3, [eye(3), t1], [eye(3), t2]));
+%
+% The optional name-value pair 'mode' selects how rays are traced: 'single'
+% (default) traces each ray on its own, which is best for incoherent rays
+% like shadow or diffuse rays; 'packet' traces consecutive rays in SIMD
+% packets of 4, 8 or 16 rays (depending on the CPU) and 'stream' traces
+% them as ray streams, both are much faster for coherent rays, e.g. primary
+% camera rays ordered by pixel.
+%
+% The optional name-value pair 't_far' limits the distance along the rays
+% (relative to the length of the ray directions), either for all rays or
+% per ray. If 'occlusion' is true, only a logical vector indicating which
+% rays hit anything within that distance is returned, which is much faster
+% than finding the closest hits, e.g. for shadow rays or line of sight
+% tests:
+%
+% visible = ~embree_intersect('ray_origins', points, 'ray_dirs', dirs, ...
+%     't_far', distances, 'occlusion', true);
+%
+% Likewise, 't_near' sets the minimum distance (default 1e-4) and 'mask' the
+% ray masks (int32 or uint32, scalar or per ray); rays only hit meshes whose
+% mask, set with 'masks' when loading the geometry, shares a bit with the
+% ray mask. A single ray origin is shared by all rays.
+%
+% Per-vertex attributes, e.g. shading normals, texture coordinates or
+% colors, can be provided with 'attributes' when loading the geometry, one
+% NV x C matrix per mesh with the same C for all meshes. Queries then
+% return them interpolated at the hit points in the field 'attributes',
+% NaN for rays that miss, like the 'points' and 'normals' fields; all of
+% them are computed in the same pass as the intersections:
+%
+% embree_intersect('vertices', V, 'faces', F, 'attributes', [N, UV]);
+%
+% With 'max_hits', up to that many hits along each ray are returned (Inf
+% for all of them), sorted by distance, e.g. for thickness measurements.
+% The rays are traced one by one regardless of 'mode'. The geometry must be
+% loaded with 'multi_hit' set to true, which slightly slows down regular
+% queries of that scene. All fields then hold one row per hit, and hits
+% offsets(r) + 1 : offsets(r + 1) belong to ray r:
+%
+% scene = embree_intersect('vertices', V, 'faces', F, 'multi_hit', true);
+% hits = embree_intersect('scene', scene, 'ray_origins', o, ...
+%     'ray_dirs', d, 'max_hits', Inf);
+% num_hits = diff(hits.offsets);
+%
+% Instead of ray origins and directions, a camera can be specified, whose
+% rays are generated on the fly, one per pixel; all fields of the result
+% are then shaped height x width (x 3). The camera is a struct with fields
+% 'model' ('pinhole' (default), 'orthographic' or 'fisheye' with
+% equidistant projection), 'K' (3 x 3 intrinsics in pixels, pixel centers
+% at 0-based integer coordinates), 'Rt' (3 x 4 world to camera transform,
+% the camera looks along its z-axis with the y-axis pointing down) and
+% 'size' ([height, width]); for pinhole cameras, t is the depth:
+%
+% camera = struct('K', [f, 0, w / 2; 0, f, h / 2; 0, 0, 1], ...
+%     'Rt', [R, t], 'size', [h, w]);
+% depth = embree_intersect('camera', camera, 'mode', 'packet').t;
 function varargout = embree_intersect(varargin)
     
     [varargin, vertices] = arg(varargin, 'vertices', {}, false);
@@ -52,9 +143,50 @@ function varargout = embree_intersect(varargin)
     [varargin, ray_origins] = arg(varargin, 'ray_origins', {}, false);
     [varargin, ray_dirs] = arg(varargin, 'ray_dirs', {}, false);
     [varargin, compute_points] = arg(varargin, 'compute_points', true, false);
+    [varargin, mode] = arg(varargin, 'mode', 'single', false);
+    [varargin, occlusion] = arg(varargin, 'occlusion', false, false);
+    [varargin, t_far] = arg(varargin, 't_far', [], false);
+    [varargin, t_near] = arg(varargin, 't_near', [], false);
+    [varargin, mask] = arg(varargin, 'mask', [], false);
+    [varargin, masks] = arg(varargin, 'masks', [], false);
+    [varargin, camera] = arg(varargin, 'camera', [], false);
+    [varargin, attributes] = arg(varargin, 'attributes', {}, false);
+    [varargin, max_hits] = arg(varargin, 'max_hits', [], false);
+    [varargin, scene] = arg(varargin, 'scene', [], false);
+    [varargin, release] = arg(varargin, 'release', [], false);
+    [varargin, dynamic] = arg(varargin, 'dynamic', false, false);
+    [varargin, multi_hit] = arg(varargin, 'multi_hit', false, false);
+    [varargin, update] = arg(varargin, 'update', {}, false);
+    [varargin, instance_of] = arg(varargin, 'instance_of', [], false);
+    [varargin, transforms] = arg(varargin, 'transforms', [], false);
     arg(varargin);
     
-    if ~isempty(vertices) && ~isempty(faces)
+    % queries without handle are traced against the default scene
+    scene_args = {};
+    if ~isempty(scene)
+        scene_args = {double(scene)};
+    end
+    
+    if ~isempty(release)
+        if islogical(release)
+            if release
+                embree_intersect_mex('release');
+            end
+        else
+            embree_intersect_mex('release', double(release));
+        end
+    elseif ~isempty(update)
+        if ~iscell(update)
+            update = {update};
+        end
+        embree_intersect_mex('update', double(scene), cfun(@single, update));
+    elseif ~isempty(instance_of)
+        if nargout > 0
+            varargout = {embree_intersect_mex('instance', double(instance_of), single(transforms))};
+        else
+            embree_intersect_mex('instance', double(instance_of), single(transforms));
+        end
+    elseif ~isempty(vertices) && ~isempty(faces)
         % geometry loading mode
         if ~iscell(vertices)
             vertices = {vertices};
@@ -65,31 +197,99 @@ function varargout = embree_intersect(varargin)
         vertices = cfun(@single, vertices);
         faces = cfun(@(f) int32(f) - 1, faces);
         
-        embree_intersect_mex(vertices, faces);
-    elseif ~isempty(ray_origins) && ~isempty(ray_dirs)
-        ray_origins = single(ray_origins);
-        ray_dirs = single(ray_dirs);
+        if ~isempty(attributes) && ~iscell(attributes)
+            attributes = {attributes};
+        end
+        attributes = cfun(@single, attributes);
+        
+        if nargout > 0
+            varargout = {embree_intersect_mex(vertices, faces, dynamic, masks, attributes, multi_hit)};
+        else
+            embree_intersect_mex(vertices, faces, dynamic, masks, attributes, multi_hit);
+        end
+    elseif ~isempty(camera) || ~isempty(ray_origins) && ~isempty(ray_dirs)
+        if ~isempty(camera)
+            ray_args = {camera_struct(camera)};
+            out_size = camera.size;
+        else
+            ray_origins = single(ray_origins);
+            ray_dirs = single(ray_dirs);
+            ray_args = {ray_origins, ray_dirs};
+            out_size = [size(ray_dirs, 1), 1];
+        end
         
-        num_rays = size(ray_dirs, 1);
-        if size(ray_origins, 1) == 1
-            ray_origins = repmat(ray_origins, num_rays, 1);
+        switch lower(mode)
+            case 'single'
+                trace_mode = 0;
+            case 'packet'
+                trace_mode = 1;
+            case 'stream'
+                trace_mode = 2;
+            otherwise
+                error('embree_intersect:invalid_mode', ...
+                    'mode must be one of ''single'', ''packet'' or ''stream''.');
         end
         
-        [geom_triangle_ids, uvts, normals] = embree_intersect_mex(ray_origins, ray_dirs);
+        if occlusion
+            varargout = {embree_intersect_mex(scene_args{:}, ray_args{:}, ...
+                trace_mode, true, single(t_far), single(t_near), mask)};
+            return;
+        end
+        
+        % normals, hit points and interpolated attributes are computed by
+        % the MEX file in the same pass as the intersections
+        hit_attributes = cell(1, 2 * compute_points);
+        if ~isempty(max_hits)
+            [offsets, geom_triangle_ids, uvts, normals, hit_attributes{:}] = embree_intersect_mex( ...
+                scene_args{:}, ray_args{:}, trace_mode, false, single(t_far), single(t_near), mask, ...
+                double(max_hits));
+            out_size = [size(geom_triangle_ids, 1), 1];
+        else
+            [geom_triangle_ids, uvts, normals, hit_attributes{:}] = embree_intersect_mex( ...
+                scene_args{:}, ray_args{:}, trace_mode, false, single(t_far), single(t_near), mask);
+        end
+        
+        % camera outputs are height x width x 3
+        geom_triangle_ids = reshape(geom_triangle_ids, [], 3);
+        uvts = reshape(uvts, [], 3);
         varargout = {struct(...
-            'objects', geom_triangle_ids(:, 2), ...
-            'triangles', geom_triangle_ids(:, 1), ...
-            'u', uvts(:, 1), ...
-            'v', uvts(:, 2), ...
-            't', uvts(:, 3), ...
-            'normals', normals ./ sqrt(sum(normals .^ 2, 2)))};
+            'objects', reshape(geom_triangle_ids(:, 2), out_size), ...
+            'triangles', reshape(geom_triangle_ids(:, 1), out_size), ...
+            'instances', reshape(geom_triangle_ids(:, 3), out_size), ...
+            'u', reshape(uvts(:, 1), out_size), ...
+            'v', reshape(uvts(:, 2), out_size), ...
+            't', reshape(uvts(:, 3), out_size), ...
+            'normals', normals)};
         
         if compute_points
-            varargout{1}.points = ray_origins + uvts(:, 3) .* ray_dirs;
-            varargout{1}.points(geom_triangle_ids(:, 1) == -1, :) = nan;
+            varargout{1}.points = hit_attributes{1};
+            if ~isempty(hit_attributes{2})
+                varargout{1}.attributes = hit_attributes{2};
+            end
+        end
+        if ~isempty(max_hits)
+            varargout{1}.offsets = offsets;
         end
     else
         error('embree_intersect:invalid_inputs', ...
             'inputs must be either vertex & face arrays, or ray origins and ray directions.');
     end
 end
+
+% convert the camera to the struct expected by the MEX file
+function camera = camera_struct(camera)
+    models = {'pinhole', 'orthographic', 'fisheye'};
+    model = 'pinhole';
+    if isfield(camera, 'model')
+        model = camera.model;
+    end
+    model_index = find(strcmpi(model, models)) - 1;
+    if isempty(model_index)
+        error('embree_intersect:invalid_camera', ...
+            'camera.model must be one of ''pinhole'', ''orthographic'' or ''fisheye''.');
+    end
+    camera = struct('model', double(model_index), ...
+        'K', double(camera.K), ...
+        'Rt', double(camera.Rt), ...
+        'size', double(camera.size(:)'));
+end
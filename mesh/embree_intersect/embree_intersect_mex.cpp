@@ -35,15 +35,24 @@
 // STL
 #ifdef _MSC_VER
 	#define _USE_MATH_DEFINES
+	#include <intrin.h>
 #endif
+#include <algorithm>
 #include <cmath>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <type_traits>
+#include <unordered_set>
+#include <vector>
 
 // OpenMP for easy parallelization
 #include <omp.h>
 
 // Eigen matrix classes
 #include <eigen3/Eigen/Core>
+#include <eigen3/Eigen/LU>
 
 // Embree
 #include <embree2/rtcore.h>
@@ -67,12 +76,14 @@ typedef Eigen::Matrix<float, Eigen::Dynamic, 3> MatrixNx3fType;
 typedef Eigen::Matrix<int, Eigen::Dynamic, 3> MatrixNx3iType;
 typedef Eigen::Map<Eigen::Matrix<float, Eigen::Dynamic, 3, Eigen::ColMajor> > mappedMatrixNx3fType;
 typedef Eigen::Map<Eigen::Matrix<int, Eigen::Dynamic, 3, Eigen::ColMajor> > mappedMatrixNx3iType;
-typedef Eigen::Map<Eigen::Matrix<int, Eigen::Dynamic, 2, Eigen::ColMajor> > mappedMatrixNx2iType;
+typedef Eigen::Map<const Eigen::Matrix<float, 3, 4, Eigen::ColMajor> > mappedMatrix3x4fType;
+typedef Eigen::Map<Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::ColMajor> > mappedMatrixXfType;
 
 static bool embree_initialized = false;
 RTCDevice embree_device;
-RTCScene embree_scene;
 
+// vertices are padded to 16 bytes, so Embree can read the last vertex of a
+// buffer with a single SSE load
 struct Vertex {
 	float x, y, z, a;
 };
@@ -81,20 +92,64 @@ struct Triangle {
 	int v0, v1, v2;
 };
 
-// global storage for vertices & faces, so they can be reused over multiple mex calls
-std::vector<Vertex*> vertices;
-std::vector<Triangle*> triangles;
+// an Embree scene with one geometry per mesh, dynamic scenes allow updating
+// the vertex positions of their meshes; instance scenes hold transformed
+// instances of other scenes instead of meshes
+struct Scene {
+	RTCScene scene;
+	bool dynamic;
+	std::vector<unsigned> geometry_ids;
+	std::vector<size_t> num_vertices;
+	
+	// vertex and index buffers of the meshes, shared with Embree, so they
+	// are stored only once and live as long as the scene
+	std::vector<std::vector<Vertex> > vertex_buffers;
+	std::vector<std::vector<Triangle> > index_buffers;
+	
+	// per-vertex attributes of the meshes (e.g. shading normals, texture
+	// coordinates or colors), interleaved per vertex
+	int num_attributes;
+	std::vector<std::vector<float> > attributes;
+	
+	// handles of the instanced scenes and the transforms of the normals
+	// from object to world space, one per instance
+	std::vector<unsigned> prototypes;
+	std::vector<Eigen::Matrix3f> normal_transforms;
+	
+	// number of instances of this scene, which must be released first
+	int num_instances;
+	
+	// whether the meshes collect hits for multi-hit queries, the filter is
+	// only registered on such scenes to keep it out of regular queries
+	bool multi_hit;
+	
+	Scene() : scene(NULL), dynamic(false), num_attributes(0), num_instances(0), multi_hit(false) {}
+};
 
-// meshes are individually specified as vertex & face matrices
-std::vector<const mappedMatrixNx3fType*> vecVertexMats;
-std::vector<const mappedMatrixNx3iType*> vecFaceMats;
+// scenes stay resident across mex calls until they are released, they are
+// addressed by handles starting at 1
+std::map<unsigned, Scene> scenes;
+unsigned next_scene_handle = 1;
 
-// this becomes true once the geometry has been provided and processed by Embree
-bool geometryLoaded = false;
+// scene traced by queries without handle, each load without handle
+// replaces it
+unsigned default_scene = 0;
 
-void deleteGeometry() {
-	if(embree_initialized && embree_scene) {
-		rtcDeleteScene(embree_scene);
+void deleteGeometry(unsigned handle) {
+	std::map<unsigned, Scene>::iterator it = scenes.find(handle);
+	if (it == scenes.end()) {
+		LOG_ERROR((std::string("Embree: there is no scene with handle ") + std::to_string(handle) + ".").c_str());
+	}
+	if (it->second.num_instances > 0) {
+		LOG_ERROR((std::string("Embree: scene ") + std::to_string(handle) + " is still instanced by another scene, release that one first.").c_str());
+	}
+	for (size_t ii = 0; ii < it->second.prototypes.size(); ii++) {
+		scenes[it->second.prototypes[ii]].num_instances--;
+	}
+	rtcDeleteScene(it->second.scene);
+	scenes.erase(it);
+	if (handle == default_scene) {
+		default_scene = 0;
 	}
 	
 	if(rtcDeviceGetError(embree_device) != RTC_NO_ERROR) {
@@ -106,16 +161,192 @@ void deleteGeometry() {
 	}
 }
 
-// preproces geometry in Embree
-inline void loadGeometry(const std::vector<const mappedMatrixNx3fType*>& V,
-						 const std::vector<const mappedMatrixNx3iType*>& F,
-						 const std::vector<int>& masks,
-						 bool isStatic = true) {
+// a hit of a multi-hit query
+struct Hit {
+	unsigned instID, geomID, primID;
+	float u, v, t;
+	float Ng[3];
 	
-	if (geometryLoaded) {
-		deleteGeometry();
+	bool operator<(const Hit& other) const {
+		return t < other.t;
 	}
+};
+
+// identifies the triangle of a hit
+struct HitKey {
+	unsigned instID, geomID, primID;
 	
+	bool operator==(const HitKey& other) const {
+		return instID == other.instID && geomID == other.geomID && primID == other.primID;
+	}
+};
+
+struct HitKeyHash {
+	size_t operator()(const HitKey& key) const {
+		return ((size_t) key.geomID * 73856093u) ^ ((size_t) key.primID * 19349663u) ^ ((size_t) key.instID * 83492791u);
+	}
+};
+
+inline HitKey hitKey(const Hit& hit) {
+	HitKey key = {hit.instID, hit.geomID, hit.primID};
+	return key;
+}
+
+// hits along the ray currently traced by this thread, the max_hits closest
+// ones are kept in a max-heap on t, so the farthest one is at the front
+struct HitCollector {
+	size_t max_hits;
+	std::vector<Hit> hits;
+	std::unordered_set<HitKey, HitKeyHash> keys;
+	
+	void clear() {
+		hits.clear();
+		keys.clear();
+	}
+};
+
+// collector of the current multi-hit ray, NULL for regular queries
+static thread_local HitCollector* hit_collector = NULL;
+
+// intersection filter of multi-hit scenes, during multi-hit queries each hit
+// is recorded and then rejected, so the traversal continues to the next one
+void collectHit(void* /*user_ptr*/, RTCRay& ray) {
+	HitCollector* collector = hit_collector;
+	if (!collector) {
+		return;
+	}
+	
+	// with max_hits hits collected, only closer ones are of interest
+	Hit hit = {ray.instID, ray.geomID, ray.primID, ray.u, ray.v, ray.tfar, {ray.Ng[0], ray.Ng[1], ray.Ng[2]}};
+	std::vector<Hit>& hits = collector->hits;
+	const bool full = hits.size() >= collector->max_hits;
+	if (full && !(hit < hits.front())) {
+		ray.geomID = RTC_INVALID_GEOMETRY_ID;
+		return;
+	}
+	
+	// BVHs with spatial splits can report the same triangle more than once
+	if (!collector->keys.insert(hitKey(hit)).second) {
+		ray.geomID = RTC_INVALID_GEOMETRY_ID;
+		return;
+	}
+	
+	if (full) {
+		// replace the farthest hit
+		std::pop_heap(hits.begin(), hits.end());
+		collector->keys.erase(hitKey(hits.back()));
+		hits.back() = hit;
+	} else {
+		hits.push_back(hit);
+	}
+	std::push_heap(hits.begin(), hits.end());
+	
+	// accepting the farthest of max_hits hits shortens the ray to it, so
+	// Embree culls everything behind it; all other hits are rejected
+	if (hits.size() >= collector->max_hits && hitKey(hits.front()) == hitKey(hit)) {
+		return;
+	}
+	ray.geomID = RTC_INVALID_GEOMETRY_ID;
+}
+
+// check the CPU for the instruction sets of the wider ray packets; other
+// compilers and architectures report neither, so packets stay 4 wide
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+inline bool cpuHasAvx() {
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx");
+}
+
+inline bool cpuHasAvx512f() {
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx512f");
+}
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+inline bool cpuHasAvx() {
+	int info[4];
+	__cpuid(info, 1);
+	// OSXSAVE & AVX flags, and the OS saving the XMM and YMM registers
+	return (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 0x06) == 0x06;
+}
+
+inline bool cpuHasAvx512f() {
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7 || !cpuHasAvx()) {
+		return false;
+	}
+	__cpuidex(info, 7, 0);
+	// AVX512F flag, and the OS saving the opmask and ZMM registers
+	return (info[1] & (1 << 16)) && (_xgetbv(0) & 0xE6) == 0xE6;
+}
+#else
+inline bool cpuHasAvx() {
+	return false;
+}
+
+inline bool cpuHasAvx512f() {
+	return false;
+}
+#endif
+
+// widest ray packet supported by both the CPU and the Embree build
+inline int packetSize() {
+	static int size = 0;
+	if (size == 0) {
+		size = 4;
+		if (rtcDeviceGetParameter1i(embree_device, RTC_CONFIG_INTERSECT16) && cpuHasAvx512f()) {
+			size = 16;
+		} else if (rtcDeviceGetParameter1i(embree_device, RTC_CONFIG_INTERSECT8) && cpuHasAvx()) {
+			size = 8;
+		}
+	}
+	return size;
+}
+
+// copy vertex positions from the column-major matrix into the interleaved
+// layout of an Embree vertex buffer
+inline void fillVertices(Vertex* vertices, const mappedMatrixNx3fType& V) {
+	const float* x = V.data();
+	const float* y = x + V.rows();
+	const float* z = y + V.rows();
+	#pragma omp parallel for
+	for(long i = 0; i < (long) V.rows(); i++) {
+		vertices[i].x = x[i];
+		vertices[i].y = y[i];
+		vertices[i].z = z[i];
+		vertices[i].a = 0.f;
+	}
+}
+
+// copy triangle indices from the column-major matrix into the interleaved
+// layout of an Embree index buffer
+inline void fillTriangles(Triangle* triangles, const mappedMatrixNx3iType& F) {
+	const int* v0 = F.data();
+	const int* v1 = v0 + F.rows();
+	const int* v2 = v1 + F.rows();
+	#pragma omp parallel for
+	for(long i = 0; i < (long) F.rows(); i++) {
+		triangles[i].v0 = v0[i];
+		triangles[i].v1 = v1[i];
+		triangles[i].v2 = v2[i];
+	}
+}
+
+// scenes are traced with single rays, ray streams and packets of the
+// widest size supported by the CPU; instanced scenes need the same flags
+inline RTCAlgorithmFlags algorithmFlags() {
+	RTCAlgorithmFlags aflags = RTC_INTERSECT1 | RTC_INTERSECT_STREAM;
+	switch (packetSize()) {
+		case 16:
+			return aflags | RTC_INTERSECT16;
+		case 8:
+			return aflags | RTC_INTERSECT8;
+		default:
+			return aflags | RTC_INTERSECT4;
+	}
+}
+
+inline void initDevice() {
 	if(!embree_initialized) { 
 		embree_device = rtcNewDevice();
 		if(rtcDeviceGetError(embree_device) != RTC_NO_ERROR) {
@@ -127,130 +358,702 @@ inline void loadGeometry(const std::vector<const mappedMatrixNx3fType*>& V,
 		}
 		embree_initialized = true;
 	}
+}
+
+// preproces geometry in Embree, returns the handle of the new scene; the
+// BVH of static scenes is built in high quality, dynamic scenes are built
+// quickly and refitted when their vertices are updated; the geometry is
+// copied once into buffers owned by the scene and shared with Embree, so
+// the MATLAB arrays don't need to outlive the call
+inline unsigned loadGeometry(const std::vector<const mappedMatrixNx3fType*>& V,
+							 const std::vector<const mappedMatrixNx3iType*>& F,
+							 const std::vector<int>& masks,
+							 bool isStatic = true,
+							 const std::vector<const mappedMatrixXfType*>& A = std::vector<const mappedMatrixXfType*>(),
+							 bool multiHit = false) {
+	
+	initDevice();
 	
 	if (V.size() == 0 || F.size() == 0) {
 		LOG_ERROR("Embree: No geometry specified!");
 	}
 	
 	// create a scene
-	RTCSceneFlags flags = RTC_SCENE_ROBUST | RTC_SCENE_HIGH_QUALITY;
+	RTCSceneFlags flags = RTC_SCENE_ROBUST;
 	if (isStatic) {
-		flags = flags | RTC_SCENE_STATIC;
+		flags = flags | RTC_SCENE_STATIC | RTC_SCENE_HIGH_QUALITY;
+	} else {
+		flags = flags | RTC_SCENE_DYNAMIC;
 	}
-	embree_scene = rtcDeviceNewScene(embree_device, flags, RTC_INTERSECT1);
+	RTCScene embree_scene = rtcDeviceNewScene(embree_device, flags, algorithmFlags());
 	
-	vertices.clear();
-	vertices.resize(V.size());
-	triangles.clear();
-	triangles.resize(V.size());
+	// the buffers must not move once shared, so the scene is filled in place
+	const unsigned handle = next_scene_handle++;
+	Scene& scene = scenes[handle];
+	scene.scene = embree_scene;
+	scene.dynamic = !isStatic;
+	scene.multi_hit = multiHit;
+	scene.vertex_buffers.resize(V.size());
+	scene.index_buffers.resize(V.size());
 	
 	// iterate over meshes
 	for (size_t m = 0; m < V.size(); m++) {
 		LOG((std::string("creating new mesh with ") + std::to_string(F[m]->rows()) + " faces and " + std::to_string(V[m]->rows()) + " vertices").c_str());
 		
 		// create triangle mesh geometry in that scene
-		unsigned geomtryID = rtcNewTriangleMesh(embree_scene, RTC_GEOMETRY_STATIC, F[m]->rows(), V[m]->rows(), 1);
+		// the same topology with moving vertices only requires refitting
+		// the BVH of deformable meshes
+		unsigned geomtryID = rtcNewTriangleMesh(embree_scene,
+			isStatic ? RTC_GEOMETRY_STATIC : RTC_GEOMETRY_DEFORMABLE, F[m]->rows(), V[m]->rows(), 1);
+		scene.geometry_ids.push_back(geomtryID);
+		scene.num_vertices.push_back(V[m]->rows());
 		
-		// fill vertex buffer
-		vertices[m] = (Vertex*) rtcMapBuffer(embree_scene, geomtryID, RTC_VERTEX_BUFFER);
-		for(size_t i = 0; i < V[m]->rows(); i++) {
-			vertices[m][i].x = (float)V[m]->coeff(i, 0);
-			vertices[m][i].y = (float)V[m]->coeff(i, 1);
-			vertices[m][i].z = (float)V[m]->coeff(i, 2);
-		}
-		rtcUnmapBuffer(embree_scene, geomtryID, RTC_VERTEX_BUFFER);
+		// fill and share vertex buffer
+		std::vector<Vertex>& vertices = scene.vertex_buffers[m];
+		vertices.resize(V[m]->rows());
+		fillVertices(vertices.data(), *V[m]);
+		rtcSetBuffer2(embree_scene, geomtryID, RTC_VERTEX_BUFFER, vertices.data(), 0, sizeof(Vertex), vertices.size());
 		
-		// fill triangle buffer
-		triangles[m] = (Triangle*) rtcMapBuffer(embree_scene,geomtryID,RTC_INDEX_BUFFER);
-		for(size_t i = 0; i < F[m]->rows(); i++) {
-			triangles[m][i].v0 = (int)F[m]->coeff(i, 0);
-			triangles[m][i].v1 = (int)F[m]->coeff(i, 1);
-			triangles[m][i].v2 = (int)F[m]->coeff(i, 2);
+		// fill and share triangle buffer
+		std::vector<Triangle>& triangles = scene.index_buffers[m];
+		triangles.resize(F[m]->rows());
+		fillTriangles(triangles.data(), *F[m]);
+		rtcSetBuffer2(embree_scene, geomtryID, RTC_INDEX_BUFFER, triangles.data(), 0, sizeof(Triangle), triangles.size());
+		
+		// per-vertex attributes are stored interleaved, so each hit reads
+		// contiguous memory
+		if (!A.empty()) {
+			scene.num_attributes = A[m]->cols();
+			scene.attributes.push_back(std::vector<float>(A[m]->size()));
+			Eigen::Map<Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> >(
+				scene.attributes.back().data(), A[m]->rows(), A[m]->cols()) = *A[m];
 		}
-		rtcUnmapBuffer(embree_scene,geomtryID,RTC_INDEX_BUFFER);
 		
 		rtcSetMask(embree_scene,geomtryID,masks[m]);
+		
+		// filter functions are only set on scenes for multi-hit queries,
+		// meshes without them use Embree's faster filter-free traversal
+		if (multiHit) {
+			rtcSetIntersectionFilterFunction(embree_scene, geomtryID, &collectHit);
+		}
 	}
 	
 	rtcCommit(embree_scene);
 	
 	if(rtcDeviceGetError(embree_device) != RTC_NO_ERROR) {
+		deleteGeometry(handle);
 		LOG_ERROR("Embree: An error occured while initializing the provided geometry!");
 	#ifdef VERBOSE
 	} else {
 		LOG("Embree: geometry added.");
 	#endif
 	}
-	geometryLoaded = true;
+	
+	return handle;
+}
+
+// create a scene of instances of the given scenes, each transformed by a
+// 3 x 4 matrix [R, t] (column-major) from object to world space; the
+// instanced scenes are shared, so their geometry and BVHs are stored only
+// once; returns the handle of the new scene
+inline unsigned instanceGeometry(const std::vector<unsigned>& prototypes, const float* transforms) {
+	bool dynamic = false;
+	for (size_t ii = 0; ii < prototypes.size(); ii++) {
+		std::map<unsigned, Scene>::const_iterator it = scenes.find(prototypes[ii]);
+		if (it == scenes.end()) {
+			LOG_ERROR((std::string("Embree: there is no scene with handle ") + std::to_string(prototypes[ii]) + ".").c_str());
+		}
+		
+		// Embree only supports a single level of instancing
+		if (!it->second.prototypes.empty()) {
+			LOG_ERROR((std::string("Embree: scene ") + std::to_string(prototypes[ii]) + " is an instance scene and cannot be instanced itself.").c_str());
+		}
+		dynamic = dynamic || it->second.dynamic;
+	}
+	if (prototypes.empty()) {
+		LOG_ERROR("Embree: No instances specified!");
+	}
+	
+	// instances of dynamic scenes are updated whenever these are refitted,
+	// which static scenes don't allow after their commit
+	Scene scene;
+	scene.scene = rtcDeviceNewScene(embree_device,
+		(dynamic ? RTC_SCENE_DYNAMIC : RTC_SCENE_STATIC) | RTC_SCENE_ROBUST, algorithmFlags());
+	scene.prototypes = prototypes;
+	
+	// attributes are only available if all instanced scenes have the same
+	// number of them
+	scene.num_attributes = scenes[prototypes[0]].num_attributes;
+	for (size_t ii = 1; ii < prototypes.size(); ii++) {
+		if (scenes[prototypes[ii]].num_attributes != scene.num_attributes) {
+			scene.num_attributes = 0;
+		}
+	}
+	
+	// likewise, multi-hit queries require all instanced scenes to support them
+	scene.multi_hit = true;
+	for (size_t ii = 0; ii < prototypes.size(); ii++) {
+		scene.multi_hit = scene.multi_hit && scenes[prototypes[ii]].multi_hit;
+	}
+	for (size_t ii = 0; ii < prototypes.size(); ii++) {
+		Scene& prototype = scenes[prototypes[ii]];
+		unsigned instID = rtcNewInstance2(scene.scene, prototype.scene, 1);
+		rtcSetTransform2(scene.scene, instID, RTC_MATRIX_COLUMN_MAJOR, transforms + 12 * ii, 0);
+		scene.geometry_ids.push_back(instID);
+		prototype.num_instances++;
+		
+		// normals transform with the inverse transpose
+		mappedMatrix3x4fType transform(transforms + 12 * ii);
+		scene.normal_transforms.push_back(transform.leftCols<3>().inverse().transpose());
+	}
+	
+	rtcCommit(scene.scene);
+	
+	if(rtcDeviceGetError(embree_device) != RTC_NO_ERROR) {
+		rtcDeleteScene(scene.scene);
+		for (size_t ii = 0; ii < prototypes.size(); ii++) {
+			scenes[prototypes[ii]].num_instances--;
+		}
+		LOG_ERROR("Embree: An error occured while instancing the provided scenes!");
+	}
+	
+	scenes[next_scene_handle] = scene;
+	return next_scene_handle++;
+}
+
+// replace the vertex positions of the meshes of a dynamic scene, empty
+// pointers keep the vertices of the corresponding mesh; scenes instancing
+// it are updated as well
+inline void updateGeometry(unsigned handle, const std::vector<const mappedMatrixNx3fType*>& V) {
+	Scene& scene = scenes[handle];
+	if (!scene.dynamic || !scene.prototypes.empty()) {
+		LOG_ERROR("Embree: only the geometry of dynamic scenes can be updated.");
+	}
+	if (V.size() != scene.geometry_ids.size()) {
+		LOG_ERROR("Embree: vertices must be provided for each mesh of the scene.");
+	}
+	for (size_t m = 0; m < V.size(); m++) {
+		if (V[m] && (size_t) V[m]->rows() != scene.num_vertices[m]) {
+			LOG_ERROR((std::string("Embree: the number of vertices of mesh #") + std::to_string(m) + " must not change.").c_str());
+		}
+	}
+	
+	for (size_t m = 0; m < V.size(); m++) {
+		if (!V[m]) {
+			continue;
+		}
+		// the shared buffer is updated in place
+		fillVertices(scene.vertex_buffers[m].data(), *V[m]);
+		rtcUpdateBuffer(scene.scene, scene.geometry_ids[m], RTC_VERTEX_BUFFER);
+	}
+	
+	rtcCommit(scene.scene);
+	
+	for (std::map<unsigned, Scene>::iterator it = scenes.begin(); it != scenes.end(); it++) {
+		bool instanced = false;
+		for (size_t ii = 0; ii < it->second.prototypes.size(); ii++) {
+			if (it->second.prototypes[ii] == handle) {
+				rtcUpdate(it->second.scene, it->second.geometry_ids[ii]);
+				instanced = true;
+			}
+		}
+		if (instanced) {
+			rtcCommit(it->second.scene);
+		}
+	}
+	
+	if(rtcDeviceGetError(embree_device) != RTC_NO_ERROR) {
+		LOG_ERROR("Embree: An error occured while updating the geometry!");
+	}
+}
+
+// release all scenes, instance scenes before the scenes they instance
+void deleteAllGeometry() {
+	while (!scenes.empty()) {
+		std::map<unsigned, Scene>::iterator it = scenes.begin();
+		while (it->second.num_instances > 0) {
+			it++;
+		}
+		deleteGeometry(it->first);
+	}
 }
 
 // clean up when MEX file is unloaded (e.g. vial "clear mex")
 static void atExit() {
-	deleteGeometry();
-	embree_initialized = false;
-	rtcDeleteDevice(embree_device);
+	deleteAllGeometry();
+	if (embree_initialized) {
+		embree_initialized = false;
+		rtcDeleteDevice(embree_device);
+	}
 	LOG("cleaning static variables.");
 }
 
-inline void createRay(RTCRay& ray, const Eigen::RowVector3f& origin, const Eigen::RowVector3f& direction, float tnear, float tfar, int mask) {
-	ray.org[0] = origin[0];
-	ray.org[1] = origin[1];
-	ray.org[2] = origin[2];
-	ray.dir[0] = direction[0];
-	ray.dir[1] = direction[1];
-	ray.dir[2] = direction[2];
-	ray.tnear = tnear;
-	ray.tfar = tfar;
+// camera models for generating primary rays
+enum CameraModel {
+	CAMERA_PINHOLE = 0,
+	CAMERA_ORTHOGRAPHIC = 1,
+	CAMERA_FISHEYE = 2
+};
+
+// camera generating one ray per pixel of a height x width image, pixels are
+// enumerated column-major like MATLAB images; the intrinsics are given by
+// focal lengths and principal point in pixels (0-based pixel centers), the
+// extrinsics by the world to camera transform [R, t], the camera looks
+// along its z-axis with the y-axis pointing down
+struct Camera {
+	CameraModel model;
+	int height, width;
+	float fx, fy, cx, cy;
+	
+	// camera to world rotation and camera center
+	Eigen::Matrix3f R;
+	Eigen::Vector3f center;
+	
+	int size() const {
+		return height * width;
+	}
+	
+	// pinhole rays have unit z-component in camera space, so their t
+	// is the depth, orthographic and fisheye rays have unit length
+	void ray(size_t p, float* org, float* dir) const {
+		const float x = ((p / height) - cx) / fx;
+		const float y = ((p % height) - cy) / fy;
+		Eigen::Vector3f o = center;
+		Eigen::Vector3f d;
+		switch (model) {
+			case CAMERA_ORTHOGRAPHIC:
+				o += R * Eigen::Vector3f(x, y, 0.f);
+				d = R.col(2);
+				break;
+			case CAMERA_FISHEYE: {
+				// equidistant projection, the distance from the principal
+				// point is proportional to the angle to the optical axis
+				const float theta = std::sqrt(x * x + y * y);
+				const float s = theta > 0.f ? std::sin(theta) / theta : 1.f;
+				d = R * Eigen::Vector3f(s * x, s * y, std::cos(theta));
+				break;
+			}
+			default:
+				d = R * Eigen::Vector3f(x, y, 1.f);
+		}
+		org[0] = o[0];
+		org[1] = o[1];
+		org[2] = o[2];
+		dir[0] = d[0];
+		dir[1] = d[1];
+		dir[2] = d[2];
+	}
+};
+
+// a ray parameter that is either the same for all rays or given per ray
+template <typename T>
+struct RayParameter {
+	T value;
+	const T* values;
+	
+	explicit RayParameter(T value) : value(value), values(NULL) {}
+	
+	T operator()(size_t p) const {
+		return values ? values[p] : value;
+	}
+};
+
+// rays to trace, given either by their origins and directions (a single
+// origin is shared by all rays) or generated by a camera, and the scene
+// they are traced against
+struct RayInputs {
+	const Scene& geometry;
+	RTCScene scene;
+	const mappedMatrixNx3fType* origins;
+	const mappedMatrixNx3fType* dirs;
+	const Camera* camera;
+	RayParameter<float> t_near;
+	RayParameter<float> t_far;
+	RayParameter<int> mask;
+	
+	// instanced scenes, one per instance, if any
+	const Scene* const* prototypes;
+	
+	RayInputs(const Scene& geometry, const mappedMatrixNx3fType& origins, const mappedMatrixNx3fType& dirs)
+		: geometry(geometry), scene(geometry.scene), origins(&origins), dirs(&dirs), camera(NULL), t_near(1e-4f),
+		  t_far(std::numeric_limits<float>::infinity()), mask(0xFFFFFFFF),
+		  prototypes(NULL) {}
+	
+	RayInputs(const Scene& geometry, const Camera& camera)
+		: geometry(geometry), scene(geometry.scene), origins(NULL), dirs(NULL), camera(&camera), t_near(1e-4f),
+		  t_far(std::numeric_limits<float>::infinity()), mask(0xFFFFFFFF),
+		  prototypes(NULL) {}
+	
+	int size() const {
+		return camera ? camera->size() : dirs->rows();
+	}
+	
+	// origin and direction of ray p
+	void ray(size_t p, float* org, float* dir) const {
+		if (camera) {
+			camera->ray(p, org, dir);
+			return;
+		}
+		const size_t q = origins->rows() == 1 ? 0 : p;
+		org[0] = (*origins)(q, 0);
+		org[1] = (*origins)(q, 1);
+		org[2] = (*origins)(q, 2);
+		dir[0] = (*dirs)(p, 0);
+		dir[1] = (*dirs)(p, 1);
+		dir[2] = (*dirs)(p, 2);
+	}
+};
+
+inline void createRay(RTCRay& ray, const RayInputs& in, size_t p) {
+	in.ray(p, ray.org, ray.dir);
+	ray.tnear = in.t_near(p);
+	ray.tfar = in.t_far(p);
 	ray.geomID = RTC_INVALID_GEOMETRY_ID;
 	ray.primID = RTC_INVALID_GEOMETRY_ID;
 	ray.instID = RTC_INVALID_GEOMETRY_ID;
-	ray.mask = mask;
+	ray.mask = in.mask(p);
 	ray.time = 0.0f;
 }
 
-inline bool intersectRay(const Eigen::RowVector3f& origin,
-						 const Eigen::RowVector3f& direction,
-						 float t_near,
-						 float t_far,
-						 int mask,
-						 size_t p,
-						 mappedMatrixNx2iType& matIDs,
-						 mappedMatrixNx3fType& matUVTs,
-						 mappedMatrixNx3fType& matNormals) {
+// output arrays of a ray query, either the closest hits or, for occlusion
+// queries, only whether each ray hits anything; hit points and attributes
+// are optional
+struct RayOutputs {
+	mappedMatrixNx3iType* ids;
+	mappedMatrixNx3fType* uvts;
+	mappedMatrixNx3fType* normals;
+	mappedMatrixNx3fType* points;
+	mappedMatrixXfType* attributes;
+	mxLogical* occluded;
+	
+	RayOutputs() : ids(NULL), uvts(NULL), normals(NULL), points(NULL), attributes(NULL), occluded(NULL) {}
+};
+
+// interpolate the per-vertex attributes of a triangle with the barycentric
+// coordinates of the hit; geometry IDs are assigned consecutively, so they
+// index the meshes of the scene
+inline void interpolateAttributes(const Scene& scene, unsigned geomID, unsigned primID, float u, float v,
+								  mappedMatrixXfType& matAttributes, size_t p) {
+	const Triangle& triangle = scene.index_buffers[geomID][primID];
+	const float* a0 = &scene.attributes[geomID][triangle.v0 * scene.num_attributes];
+	const float* a1 = &scene.attributes[geomID][triangle.v1 * scene.num_attributes];
+	const float* a2 = &scene.attributes[geomID][triangle.v2 * scene.num_attributes];
+	const float w = 1.f - u - v;
+	for (int c = 0; c < scene.num_attributes; c++) {
+		matAttributes(p, c) = w * a0[c] + u * a1[c] + v * a2[c];
+	}
+}
+
+// write the intersection of ray p to the given row of the outputs (one row
+// per ray, except for multi-hit queries), misses are marked by -1
+// IDs and UVTs and NaN normals, points and attributes; occlusion queries
+// only set geomID; normals are normalized, normals of instances are
+// transformed to world space
+inline bool storeHit(const RayInputs& in,
+					 size_t p,
+					 size_t row,
+					 unsigned instID,
+					 unsigned geomID,
+					 unsigned primID,
+					 float u,
+					 float v,
+					 float t,
+					 float ng_x,
+					 float ng_y,
+					 float ng_z,
+					 RayOutputs& out) {
+	if (out.occluded) {
+		out.occluded[p] = geomID != RTC_INVALID_GEOMETRY_ID;
+		return out.occluded[p];
+	}
+	
+	mappedMatrixNx3iType& matIDs = *out.ids;
+	mappedMatrixNx3fType& matUVTs = *out.uvts;
+	mappedMatrixNx3fType& matNormals = *out.normals;
+	if (geomID == RTC_INVALID_GEOMETRY_ID) {
+		matIDs(row, 0) = -1;
+		matIDs(row, 1) = -1;
+		matIDs(row, 2) = -1;
+		matUVTs(row, 0) = -1.f;
+		matUVTs(row, 1) = -1.f;
+		matUVTs(row, 2) = -1.f;
+		matNormals.row(row).setConstant(std::numeric_limits<float>::quiet_NaN());
+		if (out.points) {
+			out.points->row(row).setConstant(std::numeric_limits<float>::quiet_NaN());
+		}
+		if (out.attributes) {
+			out.attributes->row(row).setConstant(std::numeric_limits<float>::quiet_NaN());
+		}
+		return false;
+	}
+	
+	matIDs(row, 0) = primID;
+	matIDs(row, 1) = geomID;
+	matIDs(row, 2) = instID == RTC_INVALID_GEOMETRY_ID ? -1 : (int) instID;
+	matUVTs(row, 0) = u;
+	matUVTs(row, 1) = v;
+	matUVTs(row, 2) = t;
+	Eigen::Vector3f normal(ng_x, ng_y, ng_z);
+	if (instID != RTC_INVALID_GEOMETRY_ID) {
+		normal = in.geometry.normal_transforms[instID] * normal;
+	}
+	matNormals.row(row) = normal.normalized();
+	if (out.points) {
+		float org[3], dir[3];
+		in.ray(p, org, dir);
+		(*out.points)(row, 0) = org[0] + t * dir[0];
+		(*out.points)(row, 1) = org[1] + t * dir[1];
+		(*out.points)(row, 2) = org[2] + t * dir[2];
+	}
+	if (out.attributes) {
+		const Scene& mesh_scene = instID != RTC_INVALID_GEOMETRY_ID ? *in.prototypes[instID] : in.geometry;
+		interpolateAttributes(mesh_scene, geomID, primID, u, v, *out.attributes, row);
+	}
+	return true;
+}
+
+inline bool intersectRay(const RayInputs& in, size_t p, RayOutputs& out) {
 	RTCRay ray;
-	createRay(ray, origin, direction, t_near, t_far, mask);
+	createRay(ray, in, p);
 	
-	// shot ray
-	rtcIntersect(embree_scene, ray);
+	// shot ray, occlusion queries stop at the first hit
+	if (out.occluded) {
+		rtcOccluded(in.scene, ray);
+	} else {
+		rtcIntersect(in.scene, ray);
+	}
 	#ifdef VERBOSE
 		if(rtcGetError() != RTC_NO_ERROR) {
 			LOG_ERROR("Embree: An error occured while resetting!");
 		}
 	#endif
 	
-	// initialize outputs
-	matIDs(p, 0) = -1;
-	matIDs(p, 1) = -1;
-	matUVTs(p, 0) = -1.f;
-	matUVTs(p, 1) = -1.f;
-	matUVTs(p, 2) = -1.f;
-	matNormals(p, 0) = 0.f;
-	matNormals(p, 1) = 0.f;
-	matNormals(p, 2) = 0.f;
-	
-	if((unsigned)ray.geomID != RTC_INVALID_GEOMETRY_ID) {
-		matIDs(p, 0) = ray.primID;
-		matIDs(p, 1) = ray.geomID;
-		matUVTs(p, 0) = ray.u;
-		matUVTs(p, 1) = ray.v;
-		matUVTs(p, 2) = ray.tfar;
-		matNormals(p, 0) = ray.Ng[0];
-		matNormals(p, 1) = ray.Ng[1];
-		matNormals(p, 2) = ray.Ng[2];
-		return true;
+	return storeHit(in, p, p, ray.instID, ray.geomID, ray.primID, ray.u, ray.v, ray.tfar,
+		ray.Ng[0], ray.Ng[1], ray.Ng[2], out);
+}
+
+// packet intersection functions for each packet size
+template <typename RayN> struct Packet;
+
+template <> struct Packet<RTCRay4> {
+	static const int size = 4;
+	static void intersect(const int* valid, RTCScene scene, RTCRay4& rays) {
+		rtcIntersect4(valid, scene, rays);
+	}
+	static void occluded(const int* valid, RTCScene scene, RTCRay4& rays) {
+		rtcOccluded4(valid, scene, rays);
+	}
+};
+
+template <> struct Packet<RTCRay8> {
+	static const int size = 8;
+	static void intersect(const int* valid, RTCScene scene, RTCRay8& rays) {
+		rtcIntersect8(valid, scene, rays);
+	}
+	static void occluded(const int* valid, RTCScene scene, RTCRay8& rays) {
+		rtcOccluded8(valid, scene, rays);
+	}
+};
+
+template <> struct Packet<RTCRay16> {
+	static const int size = 16;
+	static void intersect(const int* valid, RTCScene scene, RTCRay16& rays) {
+		rtcIntersect16(valid, scene, rays);
+	}
+	static void occluded(const int* valid, RTCScene scene, RTCRay16& rays) {
+		rtcOccluded16(valid, scene, rays);
+	}
+};
+
+// trace consecutive rays in SIMD packets, which is much faster for
+// coherent rays like primary camera rays
+template <typename RayN>
+void intersectPackets(const RayInputs& in, RayOutputs& out) {
+	const int N = Packet<RayN>::size;
+	const int num_rays = in.size();
+	const int num_packets = (num_rays + N - 1) / N;
+	#pragma omp parallel for
+	for (int k = 0; k < num_packets; k++) {
+		RayN rays;
+		RTCORE_ALIGN(64) int valid[N];
+		for (int i = 0; i < N; i++) {
+			// inactive lanes of the last packet repeat its first ray
+			const int p = k * N + i < num_rays ? k * N + i : k * N;
+			valid[i] = k * N + i < num_rays ? -1 : 0;
+			float org[3], dir[3];
+			in.ray(p, org, dir);
+			rays.orgx[i] = org[0];
+			rays.orgy[i] = org[1];
+			rays.orgz[i] = org[2];
+			rays.dirx[i] = dir[0];
+			rays.diry[i] = dir[1];
+			rays.dirz[i] = dir[2];
+			rays.tnear[i] = in.t_near(p);
+			rays.tfar[i] = in.t_far(p);
+			rays.geomID[i] = RTC_INVALID_GEOMETRY_ID;
+			rays.primID[i] = RTC_INVALID_GEOMETRY_ID;
+			rays.instID[i] = RTC_INVALID_GEOMETRY_ID;
+			rays.mask[i] = in.mask(p);
+			rays.time[i] = 0.0f;
+		}
+		
+		if (out.occluded) {
+			Packet<RayN>::occluded(valid, in.scene, rays);
+		} else {
+			Packet<RayN>::intersect(valid, in.scene, rays);
+		}
+		
+		for (int i = 0; i < N && k * N + i < num_rays; i++) {
+			storeHit(in, k * N + i, k * N + i, rays.instID[i], rays.geomID[i], rays.primID[i], rays.u[i], rays.v[i], rays.tfar[i],
+				rays.Ngx[i], rays.Ngy[i], rays.Ngz[i], out);
+		}
+	}
+}
+
+// number of rays traced per ray stream
+static const int stream_size = 64;
+
+// trace consecutive rays as ray streams, which lets Embree reorder them
+// into packets internally
+void intersectStreams(const RayInputs& in, RayOutputs& out) {
+	const int num_rays = in.size();
+	const int num_streams = (num_rays + stream_size - 1) / stream_size;
+	#pragma omp parallel for
+	for (int k = 0; k < num_streams; k++) {
+		RTCRay rays[stream_size];
+		const int first = k * stream_size;
+		const int num = std::min(stream_size, num_rays - first);
+		for (int i = 0; i < num; i++) {
+			const int p = first + i;
+			createRay(rays[i], in, p);
+		}
+		
+		RTCIntersectContext context;
+		context.flags = RTC_INTERSECT_COHERENT;
+		context.userRayExt = NULL;
+		if (out.occluded) {
+			rtcOccluded1M(in.scene, &context, rays, num, sizeof(RTCRay));
+		} else {
+			rtcIntersect1M(in.scene, &context, rays, num, sizeof(RTCRay));
+		}
+		
+		for (int i = 0; i < num; i++) {
+			storeHit(in, first + i, first + i, rays[i].instID, rays[i].geomID, rays[i].primID, rays[i].u, rays[i].v, rays[i].tfar,
+				rays[i].Ng[0], rays[i].Ng[1], rays[i].Ng[2], out);
+		}
+	}
+}
+
+// find up to max_hits intersections along each ray, sorted by distance;
+// filter functions are only invoked for single rays, so the rays are traced
+// one by one
+void intersectAllHits(const RayInputs& in, size_t max_hits, std::vector<std::vector<Hit> >& hits) {
+	const int num_rays = in.size();
+	hits.resize(num_rays);
+	#pragma omp parallel
+	{
+		HitCollector collector;
+		collector.max_hits = max_hits;
+		hit_collector = &collector;
+		#pragma omp for
+		for (int p = 0; p < num_rays; p++) {
+			RTCRay ray;
+			createRay(ray, in, p);
+			collector.clear();
+			rtcIntersect(in.scene, ray);
+			std::sort_heap(collector.hits.begin(), collector.hits.end());
+			hits[p] = collector.hits;
+		}
+		hit_collector = NULL;
+	}
+}
+
+// trace all rays with the given trace mode, 0: single rays, 1: ray packets,
+// 2: ray streams
+void traceRays(const RayInputs& in, int trace_mode, RayOutputs& out) {
+	if (trace_mode == 1) {
+		switch (packetSize()) {
+			case 16:
+				intersectPackets<RTCRay16>(in, out);
+				break;
+			case 8:
+				intersectPackets<RTCRay8>(in, out);
+				break;
+			default:
+				intersectPackets<RTCRay4>(in, out);
+		}
+	} else if (trace_mode == 2) {
+		intersectStreams(in, out);
+	} else {
+		// incoherent rays are best traced one by one
+		const int num_rays = in.size();
+		#pragma omp parallel for
+		for (int p = 0; p < num_rays; p++) {
+			intersectRay(in, p, out);
+		}
+	}
+}
+
+// read an optional ray parameter that is either a scalar or given per ray
+template <typename T>
+void parseRayParameter(const mxArray* arg, size_t num_rays, const char* name, RayParameter<T>& param) {
+	if (!arg || mxIsEmpty(arg)) {
+		return;
+	}
+	if (mxGetElementSize(arg) != sizeof(T) || (mxIsSingle(arg) != std::is_same<T, float>::value)) {
+		LOG_ERROR((std::string(name) + (std::is_same<T, float>::value ? " must be provided as single precision float array." : " must be provided as int32 or uint32 array.")).c_str());
+	}
+	if (mxGetNumberOfElements(arg) == num_rays) {
+		param.values = (const T*) mxGetData(arg);
+	} else if (mxGetNumberOfElements(arg) == 1) {
+		param.value = *(const T*) mxGetData(arg);
+	} else {
+		LOG_ERROR((std::string(name) + " must be a scalar or have one element per ray.").c_str());
+	}
+}
+
+// read a double precision matrix field of the camera struct
+inline const double* cameraField(const mxArray* camera, const char* name, size_t rows, size_t cols) {
+	const mxArray* field = mxGetField(camera, 0, name);
+	if (!field || !mxIsDouble(field) || mxGetM(field) != rows || mxGetN(field) != cols) {
+		LOG_ERROR((std::string("camera.") + name + " must be a " + std::to_string(rows) + " x " + std::to_string(cols) + " double matrix.").c_str());
+	}
+	return mxGetPr(field);
+}
+
+// read the camera struct with fields model (0: pinhole, 1: orthographic,
+// 2: fisheye), K (3 x 3 intrinsics), Rt (3 x 4 world to camera transform)
+// and size ([height, width])
+inline Camera parseCamera(const mxArray* arg) {
+	Camera camera;
+	const double* model = cameraField(arg, "model", 1, 1);
+	if (*model < 0 || *model > 2) {
+		LOG_ERROR("camera.model must be 0 (pinhole), 1 (orthographic) or 2 (fisheye).");
+	}
+	camera.model = (CameraModel) (int) *model;
+	
+	const double* size = cameraField(arg, "size", 1, 2);
+	for (int ii = 0; ii < 2; ii++) {
+		if (!(size[ii] >= 1) || size[ii] != std::floor(size[ii]) || size[ii] > std::numeric_limits<int>::max()) {
+			LOG_ERROR("camera.size must hold a positive integer height and width.");
+		}
 	}
+	if (size[0] * size[1] > std::numeric_limits<int>::max()) {
+		LOG_ERROR("camera.size is too large, please render the image in tiles.");
+	}
+	camera.height = (int) size[0];
+	camera.width = (int) size[1];
 	
-	return false;
+	Eigen::Map<const Eigen::Matrix3d> K(cameraField(arg, "K", 3, 3));
+	camera.fx = K(0, 0);
+	camera.fy = K(1, 1);
+	camera.cx = K(0, 2);
+	camera.cy = K(1, 2);
+	
+	Eigen::Map<const Eigen::Matrix<double, 3, 4> > Rt(cameraField(arg, "Rt", 3, 4));
+	camera.R = Rt.leftCols<3>().transpose().cast<float>();
+	camera.center = -(camera.R * Rt.col(3).cast<float>());
+	return camera;
 }
 
 void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
@@ -261,11 +1064,81 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
 	mexAtExit(atExit);
 	
 	try {
-		if (nrhs != 2) {
-			LOG_ERROR("nrhs != 2");
+		if (nrhs < 1 || nrhs > 9) {
+			LOG_ERROR("Usage: [scene] = embree_intersect_mex(vertices, faces[, dynamic[, masks[, attributes[, multi_hit]]]]); or embree_intersect_mex('update', scene, vertices); or [scene] = embree_intersect_mex('instance', scenes, transforms); or [ids, uvts, normals, points, attributes] = embree_intersect_mex([scene, ]ray_origins, ray_dirs[, trace_mode[, occlusion[, t_far[, t_near[, mask]]]]]); or occluded = embree_intersect_mex([scene, ]ray_origins, ray_dirs, trace_mode, true[, t_far[, t_near[, mask]]]); or [offsets, ids, uvts, normals, points, attributes] = embree_intersect_mex([scene, ]ray_origins, ray_dirs, trace_mode, false, t_far, t_near, mask, max_hits); where ray_origins and ray_dirs may be replaced by a camera struct; or embree_intersect_mex('release'[, scenes]);");
+		}
+		
+		std::string str_command;
+		if (mxIsChar(prhs[0])) {
+			char* command = mxArrayToString(prhs[0]);
+			str_command = command;
+			mxFree(command);
+			if (str_command != "release" && str_command != "update" && str_command != "instance") {
+				LOG_ERROR(("unknown command " + str_command + ", only 'release', 'update' and 'instance' are supported.").c_str());
+			}
 		}
 		
-		if (mxIsCell(prhs[0]) && mxIsCell(prhs[1])) {
+		if (str_command == "instance") {
+			// instance existing scenes with one 3 x 4 transform per instance
+			if (nrhs != 3 || !mxIsDouble(prhs[1]) || mxGetClassID(prhs[2]) != mxSINGLE_CLASS
+				|| mxGetNumberOfElements(prhs[2]) != 12 * mxGetNumberOfElements(prhs[1])) {
+				LOG_ERROR("Usage: embree_intersect_mex('instance', scenes, transforms), where scenes is a double array of K scene handles and transforms is a 3 x 4 x K single precision array.");
+			}
+			initDevice();
+			std::vector<unsigned> prototypes(mxGetNumberOfElements(prhs[1]));
+			for (size_t ii = 0; ii < prototypes.size(); ii++) {
+				prototypes[ii] = (unsigned) mxGetPr(prhs[1])[ii];
+			}
+			unsigned handle = instanceGeometry(prototypes, (const float*) mxGetData(prhs[2]));
+			
+			if (nlhs > 0) {
+				plhs[0] = mxCreateDoubleScalar(handle);
+			} else {
+				if (default_scene) {
+					deleteGeometry(default_scene);
+				}
+				default_scene = handle;
+			}
+		} else if (str_command == "update") {
+			// replace the vertices of the meshes of a dynamic scene, the
+			// default scene is updated if the handle is empty
+			if (nrhs != 3 || !mxIsCell(prhs[2])) {
+				LOG_ERROR("Usage: embree_intersect_mex('update', scene, vertices), where vertices is a cell array with one (possibly empty) NV x 3 matrix per mesh.");
+			}
+			unsigned handle = mxIsEmpty(prhs[1]) ? default_scene : (unsigned) mxGetScalar(prhs[1]);
+			std::map<unsigned, Scene>::iterator it_scene = scenes.find(handle);
+			if (it_scene == scenes.end()) {
+				LOG_ERROR((std::string("there is no scene with handle ") + std::to_string(handle) + ".").c_str());
+			}
+			
+			const size_t num_meshes = mxGetNumberOfElements(prhs[2]);
+			std::vector<std::unique_ptr<mappedMatrixNx3fType> > matVertices(num_meshes);
+			std::vector<const mappedMatrixNx3fType*> vecVertices(num_meshes, NULL);
+			for (size_t ii = 0; ii < num_meshes; ii++) {
+				const mxArray* pMatVertices = mxGetCell(prhs[2], ii);
+				if (!pMatVertices || mxIsEmpty(pMatVertices)) {
+					continue;
+				}
+				if (mxGetN(pMatVertices) != 3 || mxGetClassID(pMatVertices) != mxSINGLE_CLASS) {
+					LOG_ERROR("vertices must be provided as #V x 3 single precision float arrays.");
+				}
+				matVertices[ii].reset(new mappedMatrixNx3fType((float*) mxGetData(pMatVertices), mxGetM(pMatVertices), 3));
+				vecVertices[ii] = matVertices[ii].get();
+			}
+			updateGeometry(handle, vecVertices);
+		} else if (!str_command.empty()) {
+			// release the given or all scenes
+			if (nrhs > 1) {
+				if (!mxIsDouble(prhs[1])) {
+					LOG_ERROR("scene handles must be provided as double array.");
+				}
+				for (size_t ii = 0; ii < mxGetNumberOfElements(prhs[1]); ii++) {
+					deleteGeometry((unsigned) mxGetPr(prhs[1])[ii]);
+				}
+			} else {
+				deleteAllGeometry();
+			}
+		} else if (nrhs >= 2 && nrhs <= 6 && mxIsCell(prhs[0]) && mxIsCell(prhs[1])) {
 			// initialization mode, vertices and faces are provided
 		
 			const size_t num_meshes = mxGetNumberOfElements(prhs[0]);
@@ -277,14 +1150,30 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
 			}
 			
 			
-			vecVertexMats.resize(num_meshes);
-			vecFaceMats.resize(num_meshes);
+			// the matrices only wrap the MATLAB arrays during this call
+			std::vector<std::unique_ptr<mappedMatrixNx3fType> > matVertices(num_meshes);
+			std::vector<std::unique_ptr<mappedMatrixNx3iType> > matFaces(num_meshes);
+			std::vector<const mappedMatrixNx3fType*> vecVertexMats(num_meshes);
+			std::vector<const mappedMatrixNx3iType*> vecFaceMats(num_meshes);
+			// optional geometry masks, rays only hit meshes whose mask shares
+			// a bit with the ray mask
 			std::vector<int> vecMasks(num_meshes, 0xFFFFFFFF);
+			if (nrhs > 3 && !mxIsEmpty(prhs[3])) {
+				if (mxGetElementSize(prhs[3]) != sizeof(int) || !(mxIsInt32(prhs[3]) || mxIsUint32(prhs[3]))
+					|| mxGetNumberOfElements(prhs[3]) != num_meshes) {
+					LOG_ERROR("masks must be provided as int32 or uint32 array with one element per mesh.");
+				}
+				std::copy((const int*) mxGetData(prhs[3]), (const int*) mxGetData(prhs[3]) + num_meshes, vecMasks.begin());
+			}
+			
 			for (size_t ii = 0; ii < num_meshes; ii++) {
 				mxArray* pMatVertices = mxGetCell(prhs[0], ii);
 				mxArray* pMatFaces = mxGetCell(prhs[1], ii);
 				
 				// input checks
+				if (!pMatVertices || !pMatFaces) {
+					LOG_ERROR((std::string("vertices and faces of mesh #") + std::to_string(ii) + " must be provided.").c_str());
+				}
 				if (mxGetN(pMatVertices) != 3) {
 					LOG_ERROR((std::string("Mesh vertex list #%d must be #V by 3 list of vertex positions") + std::to_string(ii)).c_str());
 				}
@@ -299,69 +1188,247 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
 				}
 				
 				// wrap in Eigen::Matrix
-				mappedMatrixNx3fType* matVertices = new mappedMatrixNx3fType((float*) mxGetData(pMatVertices), mxGetM(pMatVertices), mxGetN(pMatVertices));
-				vecVertexMats[ii] = matVertices;
-				mappedMatrixNx3iType* matFaces = new mappedMatrixNx3iType((int*) mxGetData(pMatFaces), mxGetM(pMatFaces), mxGetN(pMatFaces));
-				vecFaceMats[ii] = matFaces;
+				matVertices[ii].reset(new mappedMatrixNx3fType((float*) mxGetData(pMatVertices), mxGetM(pMatVertices), mxGetN(pMatVertices)));
+				vecVertexMats[ii] = matVertices[ii].get();
+				matFaces[ii].reset(new mappedMatrixNx3iType((int*) mxGetData(pMatFaces), mxGetM(pMatFaces), mxGetN(pMatFaces)));
+				vecFaceMats[ii] = matFaces[ii].get();
 				
 				LOG("done.");
 			}
 			
+			// optional per-vertex attributes, the same number for each mesh
+			std::vector<std::unique_ptr<mappedMatrixXfType> > matAttributes;
+			std::vector<const mappedMatrixXfType*> vecAttributeMats;
+			if (nrhs > 4 && !mxIsEmpty(prhs[4])) {
+				if (!mxIsCell(prhs[4]) || mxGetNumberOfElements(prhs[4]) != num_meshes) {
+					LOG_ERROR("attributes must be specified as cell array of NV x C matrices, one per mesh.");
+				}
+				for (size_t ii = 0; ii < num_meshes; ii++) {
+					mxArray* pMatAttributes = mxGetCell(prhs[4], ii);
+					if (!pMatAttributes || mxGetClassID(pMatAttributes) != mxSINGLE_CLASS
+						|| mxGetM(pMatAttributes) != (size_t) vecVertexMats[ii]->rows()
+						|| (ii > 0 && mxGetN(pMatAttributes) != (size_t) matAttributes[0]->cols())) {
+						LOG_ERROR((std::string("attributes of mesh #") + std::to_string(ii) + " must be a single precision float array with one row per vertex and as many columns as for the other meshes.").c_str());
+					}
+					matAttributes.emplace_back(new mappedMatrixXfType((float*) mxGetData(pMatAttributes), mxGetM(pMatAttributes), mxGetN(pMatAttributes)));
+					vecAttributeMats.push_back(matAttributes.back().get());
+				}
+			}
+			
+			// dynamic scenes are built for fast vertex updates
+			bool dynamic = nrhs > 2 && mxGetScalar(prhs[2]) != 0;
+			
+			// scenes for multi-hit queries record hits in a filter function
+			bool multi_hit = nrhs > 5 && mxGetScalar(prhs[5]) != 0;
+			
 			LOG("initializing RTC.");
-			loadGeometry(vecVertexMats, vecFaceMats, vecMasks, true);
+			unsigned handle = loadGeometry(vecVertexMats, vecFaceMats, vecMasks, !dynamic, vecAttributeMats, multi_hit);
 			LOG("done.");
-		} else {
-			// raytracing mode, only ray origins and directions are provided
-			if (!geometryLoaded) {
-				LOG_ERROR("geometry must be initialized first, please provide cell arrays of vertex and face matrices.");
-			}
 			
-			// input checks
-			if (mxGetN(prhs[0]) != 3) {
-				LOG_ERROR("Ray origin matrix must be #R x 3.");
+			if (nlhs > 0) {
+				// the scene stays resident until it is released explicitly
+				plhs[0] = mxCreateDoubleScalar(handle);
+			} else {
+				if (default_scene) {
+					deleteGeometry(default_scene);
+				}
+				default_scene = handle;
 			}
-			if (mxGetN(prhs[1]) != 3) {
-				LOG_ERROR("Ray direction matrix must be #R x 3.");
+		} else {
+			// raytracing mode, ray origins and directions or a camera are
+			// provided, optionally preceded by the handle of the scene
+			unsigned handle = default_scene;
+			const mxArray** args = prhs;
+			int nargs = nrhs;
+			if (mxIsNumeric(args[0]) && mxIsScalar(args[0]) && nargs > 1) {
+				handle = (unsigned) mxGetScalar(args[0]);
+				args++;
+				nargs--;
 			}
-			if (mxGetM(prhs[0]) != mxGetM(prhs[1])) {
-				LOG_ERROR("Number of ray origins and directions must be the same.");
+			std::map<unsigned, Scene>::const_iterator it_scene = scenes.find(handle);
+			if (it_scene == scenes.end()) {
+				LOG_ERROR(handle ? (std::string("there is no scene with handle ") + std::to_string(handle) + ".").c_str() :
+					"geometry must be initialized first, please provide cell arrays of vertex and face matrices.");
 			}
-			if (mxGetClassID(prhs[0]) != mxSINGLE_CLASS) {
-				LOG_ERROR("ray origins must be provided as single precision float array.");
+			const Scene& geometry = it_scene->second;
+			
+			std::unique_ptr<RayInputs> in;
+			std::unique_ptr<mappedMatrixNx3fType> matOrigins;
+			std::unique_ptr<mappedMatrixNx3fType> matDirs;
+			Camera camera;
+			
+			// the outputs have one row per ray, or one pixel per ray for
+			// cameras
+			std::vector<mwSize> dims(2, 1);
+			if (mxIsStruct(args[0])) {
+				camera = parseCamera(args[0]);
+				in.reset(new RayInputs(geometry, camera));
+				dims[0] = camera.height;
+				dims[1] = camera.width;
+				args++;
+				nargs--;
+			} else {
+				if (nargs < 2) {
+					LOG_ERROR("ray origins and directions must be provided.");
+				}
+				
+				// input checks
+				if (mxGetN(args[0]) != 3) {
+					LOG_ERROR("Ray origin matrix must be #R x 3.");
+				}
+				if (mxGetN(args[1]) != 3) {
+					LOG_ERROR("Ray direction matrix must be #R x 3.");
+				}
+				if (mxGetM(args[0]) != mxGetM(args[1]) && mxGetM(args[0]) != 1) {
+					LOG_ERROR("Number of ray origins and directions must be the same, or a single origin must be provided.");
+				}
+				if (mxGetClassID(args[0]) != mxSINGLE_CLASS) {
+					LOG_ERROR("ray origins must be provided as single precision float array.");
+				}
+				if (mxGetClassID(args[1]) != mxSINGLE_CLASS) {
+					LOG_ERROR("ray directions must be provided as single precision float array.");
+				}
+				
+				// wrap in Eigen::Matrix
+				matOrigins.reset(new mappedMatrixNx3fType((float*) mxGetData(args[0]), mxGetM(args[0]), mxGetN(args[0])));
+				matDirs.reset(new mappedMatrixNx3fType((float*) mxGetData(args[1]), mxGetM(args[1]), mxGetN(args[1])));
+				in.reset(new RayInputs(geometry, *matOrigins, *matDirs));
+				dims[0] = matDirs->rows();
+				args += 2;
+				nargs -= 2;
 			}
-			if (mxGetClassID(prhs[1]) != mxSINGLE_CLASS) {
-				LOG_ERROR("ray directions must be provided as single precision float array.");
+			int num_rays = in->size();
+			
+			// 0: single rays, 1: ray packets, 2: ray streams
+			int trace_mode = nargs > 0 ? (int) mxGetScalar(args[0]) : 0;
+			if (trace_mode < 0 || trace_mode > 2) {
+				LOG_ERROR("trace_mode must be 0 (single rays), 1 (packets) or 2 (streams).");
 			}
 			
-			// wrap in Eigen::Matrix
-			mappedMatrixNx3fType matOrigins((float*) mxGetData(prhs[0]), mxGetM(prhs[0]), mxGetN(prhs[0]));
-			mappedMatrixNx3fType matDirs((float*) mxGetData(prhs[1]), mxGetM(prhs[1]), mxGetN(prhs[1]));
-			int num_rays = matOrigins.rows();
+			// occlusion queries only return whether a ray hits anything
+			bool occlusion = nargs > 1 && mxGetScalar(args[1]) != 0;
 			
-			// create output matrices
-			plhs[0] = mxCreateUninitNumericMatrix(num_rays, 2, mxINT32_CLASS, mxREAL);
-			int* pi_primGeomIDs = (int*) mxGetData(plhs[0]);
+			// look up the instanced scenes once, the map must not be accessed
+			// while tracing
+			std::vector<const Scene*> prototypes;
+			for (size_t ii = 0; ii < geometry.prototypes.size(); ii++) {
+				prototypes.push_back(&scenes.find(geometry.prototypes[ii])->second);
+			}
+			if (!prototypes.empty()) {
+				in->prototypes = &prototypes[0];
+			}
 			
-			plhs[1] = mxCreateUninitNumericMatrix(num_rays, 3, mxSINGLE_CLASS, mxREAL);
-			float* pf_UVTs = (float*) mxGetData(plhs[1]);
+			// maximum distance along the rays, e.g. to a light source,
+			// minimum distance and ray masks
+			parseRayParameter(nargs > 2 ? args[2] : NULL, num_rays, "t_far", in->t_far);
+			parseRayParameter(nargs > 3 ? args[3] : NULL, num_rays, "t_near", in->t_near);
+			parseRayParameter(nargs > 4 ? args[4] : NULL, num_rays, "mask", in->mask);
 			
-			plhs[2] = mxCreateUninitNumericMatrix(num_rays, 3, mxSINGLE_CLASS, mxREAL);
-			float* pf_Normals = (float*) mxGetData(plhs[2]);
+			// multi-hit queries find up to max_hits hits per ray (Inf for
+			// all), which are returned in CSR layout: hits offsets(p) + 1 to
+			// offsets(p + 1) belong to ray p
+			size_t max_hits = 0;
+			if (nargs > 5 && !mxIsEmpty(args[5])) {
+				const double k = mxGetScalar(args[5]);
+				if (k < 1) {
+					LOG_ERROR("max_hits must be positive.");
+				}
+				if (occlusion) {
+					LOG_ERROR("occlusion queries cannot return multiple hits.");
+				}
+				if (!geometry.multi_hit) {
+					LOG_ERROR("multi-hit queries require the geometry to be loaded with multi_hit set.");
+				}
+				max_hits = std::isinf(k) ? std::numeric_limits<size_t>::max() : (size_t) k;
+			}
 			
-			mappedMatrixNx2iType matPrimGeomIDs(pi_primGeomIDs, num_rays, 2);
-			mappedMatrixNx3fType matUVTs(pf_UVTs, num_rays, 3);
-			mappedMatrixNx3fType matNormals(pf_Normals, num_rays, 3);
+			// the actual intersection tests happen here, multi-hit queries
+			// are traced first to know the number of hits
+			std::vector<std::vector<Hit> > hits;
+			int* offsets = NULL;
+			size_t num_rows = num_rays;
+			mxArray** outputs = plhs;
+			int num_outputs = nlhs;
+			if (max_hits) {
+				intersectAllHits(*in, max_hits, hits);
+				plhs[0] = mxCreateUninitNumericMatrix(num_rays + 1, 1, mxINT32_CLASS, mxREAL);
+				offsets = (int*) mxGetData(plhs[0]);
+				offsets[0] = 0;
+				for (int p = 0; p < num_rays; p++) {
+					if (offsets[p] > std::numeric_limits<int>::max() - (int) hits[p].size()) {
+						LOG_ERROR("too many hits, please trace fewer rays per call or limit max_hits.");
+					}
+					offsets[p + 1] = offsets[p] + hits[p].size();
+				}
+				num_rows = offsets[num_rays];
+				dims[0] = num_rows;
+				dims[1] = 1;
+				outputs++;
+				num_outputs--;
+			}
 			
-			// the actual intersection tests happen here
-			float t_near = 1e-4f;
-			float t_far = std::numeric_limits<float>::infinity();
-			int mask = 0xFFFFFFFF;
-			#pragma omp parallel for
-			for (size_t p = 0; p < num_rays; p++) {
-				const Eigen::Vector3f origin = matOrigins.row(p);
-				const Eigen::Vector3f dir = matDirs.row(p);
+			// create output matrices
+			RayOutputs out;
+			std::unique_ptr<mappedMatrixNx3iType> matPrimGeomIDs;
+			std::unique_ptr<mappedMatrixNx3fType> matUVTs;
+			std::unique_ptr<mappedMatrixNx3fType> matNormals;
+			std::unique_ptr<mappedMatrixNx3fType> matPoints;
+			std::unique_ptr<mappedMatrixXfType> matAttributes;
+			if (occlusion) {
+				outputs[0] = mxCreateLogicalArray(2, dims.data());
+				out.occluded = mxGetLogicals(outputs[0]);
+			} else {
+				// camera outputs are height x width x 3, which has the same
+				// memory layout as #R x 3
+				if (in->camera && !max_hits) {
+					dims.push_back(3);
+				} else {
+					dims[1] = 3;
+				}
+				outputs[0] = mxCreateUninitNumericArray(dims.size(), dims.data(), mxINT32_CLASS, mxREAL);
+				int* pi_primGeomIDs = (int*) mxGetData(outputs[0]);
+				
+				outputs[1] = mxCreateUninitNumericArray(dims.size(), dims.data(), mxSINGLE_CLASS, mxREAL);
+				float* pf_UVTs = (float*) mxGetData(outputs[1]);
+				
+				outputs[2] = mxCreateUninitNumericArray(dims.size(), dims.data(), mxSINGLE_CLASS, mxREAL);
+				float* pf_Normals = (float*) mxGetData(outputs[2]);
 				
-				intersectRay(origin, dir, t_near, t_far, mask, p, matPrimGeomIDs, matUVTs, matNormals);
+				matPrimGeomIDs.reset(new mappedMatrixNx3iType(pi_primGeomIDs, num_rows, 3));
+				matUVTs.reset(new mappedMatrixNx3fType(pf_UVTs, num_rows, 3));
+				matNormals.reset(new mappedMatrixNx3fType(pf_Normals, num_rows, 3));
+				out.ids = matPrimGeomIDs.get();
+				out.uvts = matUVTs.get();
+				out.normals = matNormals.get();
+				
+				// hit points and interpolated attributes are only computed
+				// if requested
+				if (num_outputs > 3) {
+					outputs[3] = mxCreateUninitNumericArray(dims.size(), dims.data(), mxSINGLE_CLASS, mxREAL);
+					matPoints.reset(new mappedMatrixNx3fType((float*) mxGetData(outputs[3]), num_rows, 3));
+					out.points = matPoints.get();
+				}
+				if (num_outputs > 4) {
+					dims.back() = geometry.num_attributes;
+					outputs[4] = mxCreateUninitNumericArray(dims.size(), dims.data(), mxSINGLE_CLASS, mxREAL);
+					if (geometry.num_attributes > 0) {
+						matAttributes.reset(new mappedMatrixXfType((float*) mxGetData(outputs[4]), num_rows, geometry.num_attributes));
+						out.attributes = matAttributes.get();
+					}
+				}
+			}
+			
+			if (max_hits) {
+				#pragma omp parallel for
+				for (int p = 0; p < num_rays; p++) {
+					for (size_t j = 0; j < hits[p].size(); j++) {
+						const Hit& hit = hits[p][j];
+						storeHit(*in, p, offsets[p] + j, hit.instID, hit.geomID, hit.primID, hit.u, hit.v, hit.t,
+							hit.Ng[0], hit.Ng[1], hit.Ng[2], out);
+					}
+				}
+			} else {
+				traceRays(*in, trace_mode, out);
 			}
 		}
 	} catch( std::exception& e ) {
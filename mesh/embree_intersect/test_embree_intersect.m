@@ -186,6 +186,11 @@ for ii = 1 : nl
     shadow_intersections = embree_intersect('ray_origins', ray_origins, 'ray_dirs', ray_dirs);
     shadowed{ii} = shadow_intersections.t < ts_light - 2e-4 & shadow_intersections.objects ~= -1;
     
+    % occlusion queries give the same answer without computing the hits
+    occluded = embree_intersect('ray_origins', ray_origins, 'ray_dirs', ray_dirs, ...
+        't_far', ts_light - 2e-4, 'occlusion', true);
+    assert(isequal(occluded, shadowed{ii}), 'occlusion query differs from closest hits.');
+    
     frames{ii}(:, intersected(shadowed{ii})) = 0;
     disp(ii);
 end
@@ -193,16 +198,166 @@ frames = cfun(@(f) permute(f, [2, 3, 1]), frames);
 
 sv(frames);
 
+%% trace the primary rays of the last camera in packets and streams
+cam_ray_origins = single(repmat(cam_pos, res_x * res_y, 1));
+cam_ray_dirs = single(utils.normalize(cam_dirs_world));
+modes = {'single', 'packet', 'stream'};
+mode_intersections = cell(size(modes));
+for ii = 1 : numel(modes)
+    tic;
+    mode_intersections{ii} = embree_intersect('ray_origins', cam_ray_origins, ...
+        'ray_dirs', cam_ray_dirs, 'mode', modes{ii});
+    fprintf('%s: %.3f s\n', modes{ii}, toc);
+end
+for ii = 2 : numel(modes)
+    assert(isequal(mode_intersections{ii}.objects, mode_intersections{1}.objects) ...
+        && isequal(mode_intersections{ii}.triangles, mode_intersections{1}.triangles), ...
+        'mode %s hits different triangles than single rays.', modes{ii});
+end
 
-
-
-
-
-
-
-
-
-
-
-
-
+%% keep one scene per mesh resident and alternate between them
+mesh_scenes = [embree_intersect('vertices', V0, 'faces', faces1), ...
+    embree_intersect('vertices', V1, 'faces', faces2)];
+for ii = 1 : 4
+    mesh_intersections = embree_intersect('scene', mesh_scenes(mod(ii - 1, 2) + 1), ...
+        'ray_origins', cam_ray_origins, 'ray_dirs', cam_ray_dirs);
+    assert(all(ismember(mesh_intersections.objects, [-1, 0])), ...
+        'each scene holds a single mesh.');
+end
+embree_intersect('release', mesh_scenes);
+
+%% deform the plane over several frames, refitting instead of rebuilding
+dynamic_scene = embree_intersect('vertices', {V0; V1}, 'faces', {faces1; faces2}, ...
+    'dynamic', true);
+for ii = 1 : 5
+    V0_frame = V0;
+    V0_frame(:, 3) = V0(:, 3) + 0.2 * sin(ii + V0(:, 1));
+    embree_intersect('scene', dynamic_scene, 'update', {V0_frame; []});
+    frame_intersections = embree_intersect('scene', dynamic_scene, ...
+        'ray_origins', cam_ray_origins, 'ray_dirs', cam_ray_dirs);
+    
+    % compare with a full rebuild
+    static_scene = embree_intersect('vertices', {V0_frame; V1}, 'faces', {faces1; faces2});
+    static_intersections = embree_intersect('scene', static_scene, ...
+        'ray_origins', cam_ray_origins, 'ray_dirs', cam_ray_dirs);
+    embree_intersect('release', static_scene);
+    assert(isequal(frame_intersections.triangles, static_intersections.triangles), ...
+        'refitted scene differs from rebuilt scene.');
+end
+embree_intersect('release', dynamic_scene);
+
+%% place shifted copies of the second mesh as instances of one prototype
+prototype = embree_intersect('vertices', V1, 'faces', faces2);
+offsets = [0, 0, 0; 0.5, 0, 0; -0.5, 0, 0];
+transforms = zeros(3, 4, size(offsets, 1));
+for ii = 1 : size(offsets, 1)
+    transforms(:, :, ii) = [eye(3), offsets(ii, :)'];
+end
+instanced_scene = embree_intersect('instance_of', repmat(prototype, 1, size(offsets, 1)), ...
+    'transforms', transforms);
+instance_intersections = embree_intersect('scene', instanced_scene, ...
+    'ray_origins', cam_ray_origins, 'ray_dirs', cam_ray_dirs);
+
+% the untransformed instance hits the same triangles as the prototype
+prototype_intersections = embree_intersect('scene', prototype, ...
+    'ray_origins', cam_ray_origins, 'ray_dirs', cam_ray_dirs);
+hit_first = instance_intersections.instances == 0;
+assert(all(instance_intersections.triangles(hit_first) == prototype_intersections.triangles(hit_first)), ...
+    'instance with identity transform differs from its prototype.');
+embree_intersect('release', [instanced_scene, prototype]);
+
+%% refit a dynamic prototype and trace the scene instancing it
+dynamic_prototype = embree_intersect('vertices', V0, 'faces', faces1, 'dynamic', true);
+instanced_scene = embree_intersect('instance_of', [dynamic_prototype, dynamic_prototype], ...
+    'transforms', cat(3, [eye(3), [0; 0; 0]], [eye(3), [0; 0; -1]]));
+V0_frame = V0;
+V0_frame(:, 3) = V0(:, 3) + 0.2 * sin(V0(:, 1));
+embree_intersect('scene', dynamic_prototype, 'update', {V0_frame});
+instance_intersections = embree_intersect('scene', instanced_scene, ...
+    'ray_origins', cam_ray_origins, 'ray_dirs', cam_ray_dirs);
+
+% the upper, untransformed instance must match a rebuild of the deformed mesh
+static_scene = embree_intersect('vertices', V0_frame, 'faces', faces1);
+static_intersections = embree_intersect('scene', static_scene, ...
+    'ray_origins', cam_ray_origins, 'ray_dirs', cam_ray_dirs);
+hit_first = instance_intersections.instances == 0;
+assert(isequal(hit_first, static_intersections.triangles ~= -1) ...
+    && isequal(instance_intersections.triangles(hit_first), static_intersections.triangles(hit_first)), ...
+    'instances of a refitted scene differ from the rebuilt scene.');
+embree_intersect('release', [instanced_scene, dynamic_prototype, static_scene]);
+
+%% generate the primary rays of the last camera inside the MEX file
+cam_focal_x = (res_x - 1) / (cam_right - cam_left);
+cam_focal_y = (res_y - 1) / (cam_top - cam_bottom);
+cam_world_to_cam = [cam_side; -cam_up; cam_forward];
+camera = struct('model', 'pinhole', ...
+    'K', [cam_focal_x, 0, (res_x - 1) / 2; 0, cam_focal_y, (res_y - 1) / 2; 0, 0, 1], ...
+    'Rt', [cam_world_to_cam, -cam_world_to_cam * cam_pos'], ...
+    'size', [res_y, res_x]);
+camera_intersections = embree_intersect('camera', camera, 'mode', 'packet');
+assert(isequal(size(camera_intersections.t), [res_y, res_x]), ...
+    'camera outputs must be shaped height x width.');
+assert(mean(camera_intersections.triangles(:) ~= mode_intersections{1}.triangles) < 1e-3, ...
+    'camera rays hit different triangles than explicit rays.');
+figure;
+imagesc(camera_intersections.t);
+axis image;
+title('depth');
+
+%% interpolate per-vertex normals of the sphere at the hit points
+sphere_center = [-1, -1, 0];
+sphere_scene = embree_intersect('vertices', V1, 'faces', faces2, ...
+    'attributes', V1 - sphere_center);
+sphere_intersections = embree_intersect('scene', sphere_scene, ...
+    'ray_origins', cam_pos, 'ray_dirs', cam_ray_dirs, 'mode', 'stream');
+hit = sphere_intersections.triangles ~= -1;
+assert(all(isnan(sphere_intersections.points(~hit, :)), 'all'), ...
+    'missing rays must have NaN hit points.');
+assert(max(abs(sqrt(sum((sphere_intersections.points(hit, :) - sphere_center) .^ 2, 2)) - 1)) < 1e-2, ...
+    'hit points must lie on the sphere.');
+assert(max(sum(abs(sphere_intersections.attributes(hit, :) ...
+    - (sphere_intersections.points(hit, :) - sphere_center)), 2)) < 1e-2, ...
+    'interpolated normals must match the sphere normals.');
+embree_intersect('release', sphere_scene);
+
+%% find all hits along rays through the sphere
+sphere_scene = embree_intersect('vertices', V1, 'faces', faces2, 'multi_hit', true);
+all_hits = embree_intersect('scene', sphere_scene, ...
+    'ray_origins', cam_pos, 'ray_dirs', cam_ray_dirs, 'max_hits', Inf);
+closest_hits = embree_intersect('scene', sphere_scene, ...
+    'ray_origins', cam_pos, 'ray_dirs', cam_ray_dirs);
+num_hits = diff(all_hits.offsets);
+hit = closest_hits.triangles ~= -1;
+assert(all(num_hits(~hit) == 0), 'missing rays must not have any hits.');
+% rays that are not tangent to the sphere enter and leave it
+not_tangent = hit & abs(sum(closest_hits.normals .* cam_ray_dirs, 2)) > 0.1;
+assert(all(num_hits(not_tangent) == 2), ...
+    'rays entering the closed sphere must leave it again.');
+first_hits = all_hits.offsets(hit) + 1;
+assert(isequal(all_hits.triangles(first_hits), closest_hits.triangles(hit)), ...
+    'the first of all hits must be the closest hit.');
+
+% a finite max_hits keeps the closest hits, replacing farther ones
+for max_hits = 1 : 2
+    some_hits = embree_intersect('scene', sphere_scene, ...
+        'ray_origins', cam_pos, 'ray_dirs', cam_ray_dirs, 'max_hits', max_hits);
+    assert(isequal(diff(some_hits.offsets), min(num_hits, max_hits)), ...
+        'max_hits must limit the number of hits per ray.');
+    for jj = 1 : max_hits
+        rays = find(num_hits >= jj);
+        assert(isequal(some_hits.triangles(some_hits.offsets(rays) + jj), ...
+            all_hits.triangles(all_hits.offsets(rays) + jj)), ...
+            'the hits must be the max_hits closest ones.');
+    end
+end
+some_hits = embree_intersect('scene', sphere_scene, ...
+    'ray_origins', cam_pos, 'ray_dirs', cam_ray_dirs, 'max_hits', 1);
+assert(isequal(some_hits.triangles, closest_hits.triangles(hit)) ...
+    && isequal(some_hits.t, closest_hits.t(hit)), ...
+    'a single hit must be the closest hit.');
+
+% the distance between entry and exit is the thickness along the ray
+two_hits = find(num_hits == 2);
+thickness = all_hits.t(all_hits.offsets(two_hits) + 2) - all_hits.t(all_hits.offsets(two_hits) + 1);
+assert(all(thickness > 0 & thickness <= 2 + 1e-2), 'hits must be sorted by distance.');
+embree_intersect('release', sphere_scene);